@@ -0,0 +1,1982 @@
+// Engine definitions for ledger.h, followed by the C API over it
+// (see ledger_c.h).
+#include "ledger.h"
+#include "ledger_c.h"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+Tracer g_trace;
+EngineHeap g_engineHeap;
+SettleConfig g_settleCfg;
+
+long long Tracer::nowUs() const {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - t0).count();
+}
+
+unsigned Tracer::threadId(){
+    static atomic<unsigned> next(1);
+    thread_local unsigned id = next++;
+    return id;
+}
+
+void Tracer::record(const char* name, long long ts, long long dur){
+    lock_guard<mutex> g(lock);
+    events.push_back(Event{name, ts, dur, threadId()});
+}
+
+bool Tracer::flush(string& err){
+    ofstream out(path.c_str());
+    if (!out){ err = "Cannot open trace file for writing."; return false; }
+    out << "{\"traceEvents\":[\n";
+    for (size_t i=0;i<events.size();++i){
+        const Event& e = events[i];
+        out << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"ts\":" << e.ts
+            << ",\"dur\":" << e.dur << ",\"pid\":1,\"tid\":" << e.tid << "}"
+            << (i+1<events.size() ? ",\n" : "\n");
+    }
+    out << "],\"displayTimeUnit\":\"ms\"}\n";
+    return true;
+}
+
+ShareMap::const_iterator ShareMap::find(const string& name) const {
+    const_iterator it = lower_bound(v.begin(), v.end(), name,
+        [](const pair<string,double>& x, const string& k){ return x.first < k; });
+    return (it != v.end() && it->first == name) ? it : v.end();
+}
+
+double& ShareMap::operator[](const string& name){
+    vector<pair<string,double>>::iterator it = lower_bound(v.begin(), v.end(), name,
+        [](const pair<string,double>& x, const string& k){ return x.first < k; });
+    if (it == v.end() || it->first != name) it = v.insert(it, make_pair(name, 0.0));
+    return it->second;
+}
+
+int daysFromCivil(int y, int m, int d){
+    y -= m <= 2;
+    int era = (y >= 0 ? y : y-399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int doe = yoe * 365 + yoe/4 - yoe/100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+void civilFromDays(int day, int& y, int& m, int& d){
+    int z = day + 719468;
+    int era = (z >= 0 ? z : z - 146096) / 146097;
+    int doe = z - era * 146097;
+    int yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    int doy = doe - (365*yoe + yoe/4 - yoe/100);
+    int mp = (5*doy + 2) / 153;
+    d = doy - (153*mp + 2)/5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = yoe + era * 400 + (m <= 2);
+}
+
+int daysInMonth(int y, int m){
+    static const int mdays[12] = { 31,28,31,30,31,30,31,31,30,31,30,31 };
+    bool leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+    return (m == 2 && leap) ? 29 : mdays[m-1];
+}
+
+bool parseDate(const string& s, int& day){
+    int y = 0, m = 0, d = 0;
+    char c1 = 0, c2 = 0;
+    stringstream ss(s);
+    if (!(ss >> y >> c1 >> m >> c2 >> d) || c1!='-' || c2!='-' || !ss.eof()) return false;
+    if (m < 1 || m > 12 || d < 1 || d > daysInMonth(y, m)) return false;
+    day = daysFromCivil(y, m, d);
+    return true;
+}
+
+string trimmed(const string& s){
+    size_t b = s.find_first_not_of(" \t\r"), e = s.find_last_not_of(" \t\r");
+    return b == string::npos ? string() : s.substr(b, e - b + 1);
+}
+
+string formatDate(int day){
+    int y = 0, m = 0, d = 0;
+    civilFromDays(day, y, m, d);
+    char buf[40];
+    snprintf(buf, sizeof(buf), "%04d-%02d-%02d", y, m, d);
+    return buf;
+}
+
+void Timeline::add(int day, double delta){
+    if (!pending.empty() || (!days.empty() && day < days.back())){
+        pending.push_back(make_pair(day, delta));
+    } else if (!days.empty() && day == days.back()){
+        cum.back() += delta;
+    } else {
+        days.push_back(day);
+        cum.push_back((cum.empty() ? 0.0 : cum.back()) + delta);
+    }
+}
+
+double Timeline::asOf(int day) const {
+    if (!pending.empty()) merge();
+    size_t pos = upper_bound(days.begin(), days.end(), day) - days.begin();
+    return pos ? cum[pos-1] : 0.0;
+}
+
+void Timeline::merge() const {
+    sort(pending.begin(), pending.end());
+    vector<int> d;
+    vector<double> c;
+    d.reserve(days.size() + pending.size());
+    c.reserve(days.size() + pending.size());
+    size_t i = 0, j = 0;
+    double prev = 0.0, run = 0.0;   // prev: cum[i-1] of the old sums
+    while (i < days.size() || j < pending.size()){
+        int day = (j == pending.size() || (i < days.size() && days[i] <= pending[j].first)) ? days[i] : pending[j].first;
+        if (i < days.size() && days[i] == day){ run += cum[i] - prev; prev = cum[i]; ++i; }
+        for (; j < pending.size() && pending[j].first == day; ++j) run += pending[j].second;
+        d.push_back(day);
+        c.push_back(run);
+    }
+    days.swap(d);
+    cum.swap(c);
+    pending.clear();
+}
+
+void EngineHeap::add(long long n){
+    if (!on) return;
+    cur += n;
+    if (cur > peak) peak = cur;
+}
+
+vector<tuple<string,string,double>> settleGreedy(const map<string,double>& net){
+    return settleGreedyOver(net);
+}
+
+vector<tuple<string,string,double>> settlePairsGreedy(const map<string,double>& net){
+    // bucket creditors by amount rounded to cents
+    EngineMap<long long, EngineVec<string>> credByCents;
+    for (map<string,double>::const_iterator it = net.begin(); it != net.end(); ++it)
+        if (it->second > EPS) credByCents[llround(it->second * 100.0)].push_back(it->first);
+
+    vector<tuple<string,string,double>> txns;
+    EngineMap<string,double> rest;
+    for (map<string,double>::const_iterator it = net.begin(); it != net.end(); ++it){
+        if (it->second >= -EPS) continue;
+        EngineMap<long long, EngineVec<string>>::iterator m = credByCents.find(llround(-it->second * 100.0));
+        if (m != credByCents.end() && !m->second.empty()){
+            const string& cred = m->second.back();
+            double owed = net.find(cred)->second;
+            double pay = std::min(owed, -it->second);
+            txns.push_back(make_tuple(it->first, cred, pay));
+            if (owed - pay > EPS) rest[cred] = owed - pay;
+            if (it->second + pay < -EPS) rest[it->first] = it->second + pay;
+            m->second.pop_back();
+        } else {
+            rest[it->first] = it->second;
+        }
+    }
+    for (EngineMap<long long, EngineVec<string>>::const_iterator it = credByCents.begin(); it != credByCents.end(); ++it)
+        for (size_t i=0;i<it->second.size();++i) rest[it->second[i]] = net.find(it->second[i])->second;
+
+    vector<tuple<string,string,double>> more = settleGreedyOver(rest);
+    txns.insert(txns.end(), more.begin(), more.end());
+    return txns;
+}
+
+vector<tuple<string,string,double>> settleExact(const map<string,double>& net){
+    EngineVec<pair<string,long long>> v; // non-zero balances in cents
+    for (map<string,double>::const_iterator it = net.begin(); it != net.end(); ++it)
+        if (fabs(it->second) > EPS) v.push_back(make_pair(it->first, llround(it->second * 100.0)));
+    size_t n = v.size();
+    if (n > EXACT_HARD_MAX) return settleGreedy(net);
+
+    size_t full = static_cast<size_t>(1) << n;
+    EngineVec<long long> sum(full, 0);
+    EngineVec<unsigned char> dp(full, 0), via(full, 0);
+    for (size_t mask=1; mask<full; ++mask){
+        size_t low = 0;
+        while (!(mask & (static_cast<size_t>(1) << low))) ++low;
+        sum[mask] = sum[mask & (mask-1)] + v[low].second;
+        unsigned char best = 0, arg = static_cast<unsigned char>(low);
+        for (size_t i=low; i<n; ++i){
+            size_t bit = static_cast<size_t>(1) << i;
+            if ((mask & bit) && dp[mask ^ bit] > best){ best = dp[mask ^ bit]; arg = static_cast<unsigned char>(i); }
+        }
+        dp[mask] = static_cast<unsigned char>(best + (sum[mask]==0 ? 1 : 0));
+        via[mask] = arg;
+    }
+
+    // Walk the optimal removal chain; every zero-sum mask closes a group.
+    vector<tuple<string,string,double>> txns;
+    EngineMap<string,double> group;
+    size_t mask = full - 1;
+    while (mask){
+        size_t i = via[mask];
+        group[v[i].first] = net.find(v[i].first)->second;
+        mask ^= static_cast<size_t>(1) << i;
+        if (sum[mask]==0){
+            vector<tuple<string,string,double>> g = settleGreedyOver(group);
+            txns.insert(txns.end(), g.begin(), g.end());
+            // the group is zero-sum only to the cent: what it leaves over
+            // (sub-cent) goes on with the next group, the last one settles it
+            for (size_t k=0;k<g.size();++k){
+                group[get<0>(g[k])] += get<2>(g[k]);
+                group[get<1>(g[k])] -= get<2>(g[k]);
+            }
+            for (EngineMap<string,double>::iterator it = group.begin(); it != group.end(); )
+                if (fabs(it->second) <= EPS) it = group.erase(it); else ++it;
+        }
+    }
+    return txns;
+}
+
+bool SettleConfig::save(const string& path, string& err) const {
+    ofstream out(path.c_str());
+    if (!out){ err="Cannot open config for writing."; return false; }
+    out << "exact_max " << exactMax << "\n";
+    out << "budget_ms " << budgetMs << "\n";
+    out << "pair_share " << pairShare << "\n";
+    return true;
+}
+
+void SettleConfig::load(const string& path){
+    ifstream in(path.c_str());
+    string key;
+    while (in >> key){
+        if (key=="exact_max") in >> exactMax;
+        else if (key=="budget_ms") in >> budgetMs;
+        else if (key=="pair_share") in >> pairShare;
+        else in.ignore(numeric_limits<streamsize>::max(), '\n');
+    }
+    if (exactMax > EXACT_HARD_MAX) exactMax = EXACT_HARD_MAX;
+}
+
+vector<tuple<string,string,double>> settleAdaptive(const map<string,double>& net,
+        const vector<vector<string>>& components, const SettleConfig& cfg, AutoStats& stats){
+    vector<tuple<string,string,double>> txns;
+    for (size_t c=0;c<components.size();++c){
+        map<string,double> part;
+        map<long long,size_t> amounts;
+        for (size_t i=0;i<components[c].size();++i){
+            double amt = net.find(components[c][i])->second;
+            if (fabs(amt) <= EPS) continue;
+            part[components[c][i]] = amt;
+            ++amounts[llround(fabs(amt) * 100.0)];
+        }
+        if (part.empty()) continue;
+
+        vector<tuple<string,string,double>> t;
+        if (part.size() <= cfg.exactMax){ t = settleExact(part); ++stats.exact; }
+        else if (1.0 - static_cast<double>(amounts.size()) / static_cast<double>(part.size()) >= cfg.pairShare){
+            t = settlePairsGreedy(part); ++stats.paired;
+        }
+        else { t = settleGreedy(part); ++stats.greedy; }
+        txns.insert(txns.end(), t.begin(), t.end());
+    }
+    return txns;
+}
+
+vector<tuple<string,string,double>> settleAuto(const map<string,double>& net){
+    vector<vector<string>> one(1);
+    for (map<string,double>::const_iterator it = net.begin(); it != net.end(); ++it) one[0].push_back(it->first);
+    AutoStats stats;
+    return settleAdaptive(net, one, g_settleCfg, stats);
+}
+
+const vector<SettleEngine>& settleEngines(){
+    static const vector<SettleEngine> engines = {
+        { "greedy", settleGreedy, 0 },
+        { "pairs+greedy", settlePairsGreedy, 0 },
+        { "exact", settleExact, 20 },
+        { "auto", settleAuto, 0 },
+    };
+    return engines;
+}
+
+size_t PairTable::hash(uint64_t k){
+    k ^= k >> 33; k *= 0xff51afd7ed558ccdULL; k ^= k >> 33;
+    return static_cast<size_t>(k);
+}
+
+void PairTable::add(size_t from, size_t to, double amt){
+    if (from > to){ std::swap(from, to); amt = -amt; }
+    if ((used + 1) * 10 > keys.size() * 7) grow();
+    uint64_t k = key(from, to);
+    size_t mask = keys.size() - 1;
+    size_t i = hash(k) & mask;
+    while (keys[i] != EMPTY && keys[i] != k) i = (i + 1) & mask;
+    if (keys[i] == EMPTY){ keys[i] = k; vals[i] = 0.0; ++used; }
+    vals[i] += amt;
+}
+
+double PairTable::owed(size_t from, size_t to) const {
+    if (keys.empty() || from == to) return 0.0;
+    double sign = 1.0;
+    if (from > to){ std::swap(from, to); sign = -1.0; }
+    uint64_t k = key(from, to);
+    size_t mask = keys.size() - 1;
+    for (size_t i = hash(k) & mask; keys[i] != EMPTY; i = (i + 1) & mask)
+        if (keys[i] == k) return sign * vals[i];
+    return 0.0;
+}
+
+void PairTable::grow(){
+    vector<uint64_t> oldKeys; oldKeys.swap(keys);
+    vector<double> oldVals; oldVals.swap(vals);
+    size_t cap = oldKeys.empty() ? 16 : oldKeys.size() * 2;
+    keys.assign(cap, EMPTY);
+    vals.assign(cap, 0.0);
+    size_t mask = cap - 1;
+    for (size_t j=0;j<oldKeys.size();++j){
+        if (oldKeys[j] == EMPTY) continue;
+        size_t i = hash(oldKeys[j]) & mask;
+        while (keys[i] != EMPTY) i = (i + 1) & mask;
+        keys[i] = oldKeys[j]; vals[i] = oldVals[j];
+    }
+}
+
+bool FingerprintSet::contains(uint64_t k) const {
+    if (keys.empty()) return false;
+    size_t mask = keys.size() - 1;
+    for (size_t i = PairTable::hash(k) & mask; keys[i] != 0; i = (i + 1) & mask)
+        if (keys[i] == k) return true;
+    return false;
+}
+
+void FingerprintSet::insert(uint64_t k){
+    if ((used + 1) * 10 > keys.size() * 7) grow();
+    size_t mask = keys.size() - 1;
+    size_t i = PairTable::hash(k) & mask;
+    while (keys[i] != 0 && keys[i] != k) i = (i + 1) & mask;
+    if (keys[i] == 0){ keys[i] = k; ++used; }
+}
+
+void FingerprintSet::erase(uint64_t k){
+    if (keys.empty()) return;
+    size_t mask = keys.size() - 1;
+    size_t i = PairTable::hash(k) & mask;
+    while (keys[i] != k){ if (keys[i] == 0) return; i = (i + 1) & mask; }
+    keys[i] = 0; --used;
+    // backward-shift deletion: pull up entries whose probe run passed i
+    for (size_t j = (i + 1) & mask; keys[j] != 0; j = (j + 1) & mask){
+        size_t home = PairTable::hash(keys[j]) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)){ keys[i] = keys[j]; keys[j] = 0; i = j; }
+    }
+}
+
+void FingerprintSet::grow(){
+    vector<uint64_t> old; old.swap(keys);
+    keys.assign(old.empty() ? 16 : old.size() * 2, 0);
+    used = 0;
+    for (size_t j=0;j<old.size();++j) if (old[j] != 0) insert(old[j]);
+}
+
+int RecurringRule::occurrence(long long i) const {
+    if (!months) return e.day + static_cast<int>(i * step);
+    int y = 0, m = 0, d = 0;
+    civilFromDays(e.day, y, m, d);
+    long long mm = (m - 1) + i * step;
+    int yy = y + static_cast<int>(mm / 12), mo = static_cast<int>(mm % 12) + 1;
+    return daysFromCivil(yy, mo, std::min(d, daysInMonth(yy, mo)));
+}
+
+long long RecurringRule::through(int day) const {
+    if (day < e.day) return 0;
+    long long k;
+    if (!months) k = (day - e.day) / step;
+    else {
+        int y1 = 0, m1 = 0, d1 = 0, y2 = 0, m2 = 0, d2 = 0;
+        civilFromDays(e.day, y1, m1, d1);
+        civilFromDays(day, y2, m2, d2);
+        k = ((y2 * 12LL + m2) - (y1 * 12LL + m1)) / step;
+        if (occurrence(k) > day) --k;
+    }
+    return std::min(k + 1, count);
+}
+
+string RecurringRule::periodName() const {
+    if (months) return step == 1 ? "monthly" : step == 12 ? "yearly" : to_string(step) + "m";
+    return step == 1 ? "daily" : step == 7 ? "weekly" : to_string(step) + "d";
+}
+
+bool parsePeriod(const string& s, int& step, bool& months){
+    if (s=="daily"){ step = 1; months = false; return true; }
+    if (s=="weekly"){ step = 7; months = false; return true; }
+    if (s=="monthly"){ step = 1; months = true; return true; }
+    if (s=="yearly"){ step = 12; months = true; return true; }
+    if (s.size() < 2) return false;
+    char unit = s[s.size()-1];
+    if (unit!='d' && unit!='m') return false;
+    int n = 0;
+    for (size_t i=0;i+1<s.size();++i){
+        if (!isdigit(static_cast<unsigned char>(s[i])) || n > 100000) return false;
+        n = n * 10 + (s[i] - '0');
+    }
+    if (n <= 0) return false;
+    step = n; months = (unit=='m');
+    return true;
+}
+
+void PendingBatch::stage(Expense e){
+    if (e.importHash) hashes.insert(e.importHash);
+    expenses.push_back(std::move(e));
+}
+
+void PendingBatch::clear(){
+    open = false; errors = skipped = 0;
+    expenses.clear(); transfers.clear(); hashes.clear();
+}
+
+bool syncFile(FILE* f){
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0;
+#else
+    return fsync(fileno(f)) == 0;
+#endif
+}
+
+void Book::addUser(const string& u){
+    if (hasUser(u)) return;
+    ids[u] = names.size();
+    names.push_back(u);
+    for (size_t c=0;c<timelines.size();++c) timelines[c].push_back(Timeline());
+    postings.push_back(vector<size_t>());
+    bal.push_back(0.0);
+    ranked.insert(make_pair(0.0, names.size()-1));
+    for (size_t c=1;c<ccyBal.size();++c) ccyBal[c].push_back(0.0);
+    logMutation(Mutation::ADD_USER, names.size()-1);
+}
+
+void Book::logMutation(Mutation::Kind kind, size_t id){
+    undoLog.push_back(Mutation{kind, id});
+    redoStack.clear();
+    lastPlan.clear();   // a plan is only valid against the balances it came from
+}
+
+bool Book::undo(string& what, string& err){
+    if (undoLog.empty()){ err = "Nothing to undo."; return false; }
+    Mutation m = undoLog.back(); undoLog.pop_back();
+    lastPlan.clear();
+    Undone u; u.kind = m.kind; u.id = m.id;
+    if (m.kind == Mutation::ADD_EXPENSE){
+        unindexExpense(m.id);
+        u.expense = std::move(expenses.back());
+        expenses.pop_back();
+        what = "add-expense #" + to_string(m.id);
+    } else if (m.kind == Mutation::REMOVE_EXPENSE){
+        expenses[m.id] = std::move(undoPayloads.back());
+        undoPayloads.pop_back();
+        indexExpense(m.id);
+        what = "remove-expense #" + to_string(m.id);
+    } else if (m.kind == Mutation::EDIT_EXPENSE){
+        unindexExpense(m.id);
+        u.expense = std::move(expenses[m.id]);
+        expenses[m.id] = std::move(undoPayloads.back());
+        undoPayloads.pop_back();
+        indexExpense(m.id);
+        what = "edit-expense #" + to_string(m.id);
+    } else if (m.kind == Mutation::ADD_GROUP){
+        u.name = groups.back();
+        u.parent = groupParent.back();
+        groupIds.erase(u.name);
+        --groupChildren[u.parent];
+        groups.pop_back(); groupParent.pop_back(); groupChildren.pop_back();
+        groupExpenses.pop_back(); groupBal.pop_back();
+        what = "add-group " + u.name;
+    } else if (m.kind == Mutation::PAYMENT){
+        u.transfer = transfers.back();
+        applyTransfer(u.transfer, -1.0);
+        transfers.pop_back();
+        what = "pay " + names[u.transfer.from] + " " + names[u.transfer.to];
+    } else if (m.kind == Mutation::ADD_RULE){
+        applyRule(m.id, -rules.back().applied);
+        --groupExpenses[rules.back().e.group];
+        u.rule = std::move(rules.back());
+        rules.pop_back();
+        what = "add-recurring r" + to_string(m.id);
+    } else if (m.kind == Mutation::END_RULE){
+        u.rule = rules[m.id];
+        setRuleCount(m.id, undoCounts.back());
+        undoCounts.pop_back();
+        what = "end-recurring r" + to_string(m.id);
+    } else {
+        u.name = std::move(names.back());
+        names.pop_back();
+        ids.erase(u.name);
+        ranked.erase(make_pair(bal.back(), names.size()));
+        if (compactUser == names.size()){
+            // drop the pass over the removed list, resetting its marks
+            for (size_t i=compactClear;i<compactWrite;++i) compactSeen[postings.back()[i]] = 0;
+            compactUser = NO_USER;
+        }
+        if (postingGarbage.size() > names.size()) postingGarbage[names.size()] = 0;
+        postings.pop_back(); bal.pop_back();
+        for (size_t c=0;c<timelines.size();++c) timelines[c].pop_back();
+        for (size_t c=1;c<ccyBal.size();++c) ccyBal[c].pop_back();
+        ++userGeneration;   // the id is free for the next add-user
+        what = "add-user " + u.name;
+    }
+    redoStack.push_back(std::move(u));
+    return true;
+}
+
+bool Book::redo(string& what, string& err){
+    if (redoStack.empty()){ err = "Nothing to redo."; return false; }
+    Undone u = std::move(redoStack.back()); redoStack.pop_back();
+    vector<Undone> keep; keep.swap(redoStack);   // logMutation() clears the redo stack
+    if (u.kind == Mutation::ADD_EXPENSE){
+        expenses.push_back(std::move(u.expense));
+        indexExpense(expenses.size()-1);
+        logMutation(Mutation::ADD_EXPENSE, expenses.size()-1);
+        what = "add-expense #" + to_string(expenses.size()-1);
+    } else if (u.kind == Mutation::REMOVE_EXPENSE){
+        removeExpense(u.id, err, false);
+        what = "remove-expense #" + to_string(u.id);
+    } else if (u.kind == Mutation::EDIT_EXPENSE){
+        replaceExpense(u.id, u.expense, false);
+        what = "edit-expense #" + to_string(u.id);
+    } else if (u.kind == Mutation::ADD_GROUP){
+        addGroup(u.name, u.parent);
+        what = "add-group " + u.name;
+    } else if (u.kind == Mutation::PAYMENT){
+        recordPayment(u.transfer);
+        what = "pay " + names[u.transfer.from] + " " + names[u.transfer.to];
+    } else if (u.kind == Mutation::ADD_RULE){
+        addRecurring(u.rule);
+        what = "add-recurring r" + to_string(rules.size()-1);
+    } else if (u.kind == Mutation::END_RULE){
+        undoCounts.push_back(rules[u.id].count);
+        setRuleCount(u.id, u.rule.count);
+        logMutation(Mutation::END_RULE, u.id);
+        what = "end-recurring r" + to_string(u.id);
+    } else {
+        what = "add-user " + u.name;
+        addUser(u.name);
+    }
+    redoStack.swap(keep);
+    return true;
+}
+
+void Book::adjustBalance(size_t u, double delta){
+    if (deferRanked){
+        if (!rankedMark[u]){ rankedMark[u] = 1; rankedDirty.push_back(make_pair(u, bal[u])); }
+        bal[u] += delta;
+        return;
+    }
+    ranked.erase(make_pair(bal[u], u));
+    bal[u] += delta;
+    ranked.insert(make_pair(bal[u], u));
+}
+
+int Book::addGroup(const string& name, int parent){
+    int id = static_cast<int>(groups.size());
+    groups.push_back(name);
+    groupParent.push_back(parent);
+    groupIds[name] = id;
+    groupChildren.push_back(0); groupExpenses.push_back(0);
+    groupBal.push_back(unordered_map<uint64_t,double>());
+    ++groupChildren[parent];
+    logMutation(Mutation::ADD_GROUP, id);
+    return id;
+}
+
+void Book::groupExpense(const Expense& e, double sign){
+    if (e.group == 0) return;
+    size_t payer = userId(e.payer);
+    for (int g = e.group; g != 0; g = groupParent[g]){
+        unordered_map<uint64_t,double>& b = groupBal[g];
+        b[currencyKey(e.currency, payer)] += sign * e.amount;
+        for (ShareMap::const_iterator it = e.shares.begin(); it != e.shares.end(); ++it)
+            b[currencyKey(e.currency, userId(it->first))] -= sign * it->second;
+    }
+}
+
+uint64_t Book::currencyKey(int currency, size_t user){
+    return (static_cast<uint64_t>(currency) << 32) | static_cast<uint64_t>(user);
+}
+
+map<string,double> Book::groupNet(int g, int currency) const {
+    map<string,double> net;
+    for (unordered_map<uint64_t,double>::const_iterator it = groupBal[g].begin(); it != groupBal[g].end(); ++it){
+        if (static_cast<int>(it->first >> 32) != currency) continue;
+        double v = it->second;
+        net[names[static_cast<size_t>(it->first & 0xffffffffu)]] = fabs(v) < 1e-9 ? 0.0 : v;
+    }
+    return net;
+}
+
+// FNV-1a accumulator for contentHash(); strings end with a NUL byte.
+struct ContentMix {
+    uint64_t h = 1469598103934665603ULL;
+    void bytes(const void* p, size_t n){
+        const unsigned char* c = static_cast<const unsigned char*>(p);
+        for (size_t i=0;i<n;++i){ h ^= c[i]; h *= 1099511628211ULL; }
+    }
+    void str(string_view s){ bytes(s.data(), s.size()); bytes("", 1); }
+    void num(long long v){ bytes(&v, sizeof v); }
+    uint64_t done() const { return h ? h : 1; }
+};
+
+uint64_t Book::contentHash(const Expense& e, const string& ref) const {
+    ContentMix mix;
+    mix.str(e.payer);
+    mix.num(llround(e.amount * 100));
+    mix.str(currencies[e.currency]);
+    mix.num(e.day);
+    for (ShareMap::const_iterator it = e.shares.begin(); it != e.shares.end(); ++it){
+        mix.str(it->first);
+        mix.num(llround(it->second * 100));
+    }
+    mix.str(ref);
+    return mix.done();
+}
+
+uint64_t Book::contentHash(string_view payer, double amount, int currency, int day,
+                           const vector<pair<string_view,double>>& shares, string_view ref) const {
+    ContentMix mix;
+    mix.str(payer);
+    mix.num(llround(amount * 100));
+    mix.str(currencies[currency]);
+    mix.num(day);
+    for (size_t i=0;i<shares.size();++i){
+        mix.str(shares[i].first);
+        mix.num(llround(shares[i].second * 100));
+    }
+    mix.str(ref);
+    return mix.done();
+}
+
+void Book::internNote(const string& text, uint32_t& off, uint32_t& len){
+    off = static_cast<uint32_t>(notePool.size());
+    len = static_cast<uint32_t>(text.size());
+    notePool += text;
+}
+
+uint32_t Book::trigramKey(const char* p){
+    return (static_cast<uint32_t>(static_cast<unsigned char>(tolower(static_cast<unsigned char>(p[0])))) << 16)
+         | (static_cast<uint32_t>(static_cast<unsigned char>(tolower(static_cast<unsigned char>(p[1])))) << 8)
+         |  static_cast<uint32_t>(static_cast<unsigned char>(tolower(static_cast<unsigned char>(p[2]))));
+}
+
+void Book::indexNote(const Expense& e, size_t id){
+    if (e.noteLen < 3) return;
+    const char* p = notePool.data() + e.noteOff;
+    vector<uint32_t> keys;
+    for (uint32_t i=0;i+3<=e.noteLen;++i) keys.push_back(trigramKey(p + i));
+    sort(keys.begin(), keys.end());
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+    for (size_t i=0;i<keys.size();++i){
+        vector<size_t>& list = trigrams[keys[i]];
+        if (list.empty() || list.back() != id) list.push_back(id);
+    }
+}
+
+vector<size_t> Book::search(const string& text) const {
+    vector<size_t> cand;
+    if (text.size() >= 3){
+        const vector<size_t>* best = nullptr;
+        for (size_t i=0;i+3<=text.size();++i){
+            unordered_map<uint32_t, vector<size_t>>::const_iterator it = trigrams.find(trigramKey(text.data() + i));
+            if (it == trigrams.end()) return cand;
+            if (!best || it->second.size() < best->size()) best = &it->second;
+        }
+        cand = *best;
+        sort(cand.begin(), cand.end());
+        cand.erase(unique(cand.begin(), cand.end()), cand.end());
+    } else {
+        for (size_t i=0;i<expenses.size();++i) cand.push_back(i);
+    }
+    vector<size_t> out;
+    for (size_t i=0;i<cand.size();++i){
+        if (!isLive(cand[i])) continue;
+        const Expense& e = expenses[cand[i]];
+        const char* b = notePool.data() + e.noteOff;
+        const char* f = std::search(b, b + e.noteLen, text.begin(), text.end(),
+            [](char x, char y){ return tolower(static_cast<unsigned char>(x)) == tolower(static_cast<unsigned char>(y)); });
+        if (e.noteLen && f != b + e.noteLen) out.push_back(cand[i]);
+    }
+    return out;
+}
+
+vector<size_t> Book::expensesInRange(double lo, double hi, size_t payer) const {
+    flushAmountIndex();
+    vector<size_t> out;
+    if (payer == NO_USER){
+        set<pair<double,size_t>>::const_iterator it = byAmount.lower_bound(make_pair(lo, size_t(0)));
+        for (; it != byAmount.end() && it->first <= hi; ++it) out.push_back(it->second);
+    } else {
+        set<tuple<size_t,double,size_t>>::const_iterator it = byPayerAmount.lower_bound(make_tuple(payer, lo, size_t(0)));
+        for (; it != byPayerAmount.end() && get<0>(*it) == payer && get<1>(*it) <= hi; ++it) out.push_back(get<2>(*it));
+    }
+    return out;
+}
+
+vector<size_t> Book::top(size_t k, bool debtors) const {
+    vector<size_t> out;
+    if (debtors){
+        for (set<pair<double,size_t>>::const_iterator it = ranked.begin();
+             it != ranked.end() && out.size() < k && it->first < -EPS; ++it)
+            out.push_back(it->second);
+    } else {
+        for (set<pair<double,size_t>>::const_reverse_iterator it = ranked.rbegin();
+             it != ranked.rend() && out.size() < k && it->first > EPS; ++it)
+            out.push_back(it->second);
+    }
+    return out;
+}
+
+int Book::internCategory(const string& name){
+    if (name.empty()) return 0;
+    unordered_map<string,int>::const_iterator it = categoryIds.find(name);
+    if (it != categoryIds.end()) return it->second;
+    int id = static_cast<int>(categories.size());
+    categories.push_back(name);
+    for (size_t c=0;c<categoryTotals.size();++c) categoryTotals[c].push_back(Rollup());
+    categoryIds[name] = id;
+    return id;
+}
+
+InternMark Book::internMark() const {
+    InternMark m;
+    m.notes = notePool.size();
+    m.categories = categories.size();
+    return m;
+}
+
+void Book::dropInterned(const InternMark& m){
+    notePool.resize(m.notes);
+    while (categories.size() > m.categories){
+        categoryIds.erase(categories.back());
+        categories.pop_back();
+        for (size_t c=0;c<categoryTotals.size();++c) categoryTotals[c].pop_back();
+    }
+}
+
+int Book::internCurrency(const string& code){
+    if (code.empty()) return 0;
+    unordered_map<string,int>::const_iterator it = currencyIds.find(code);
+    if (it != currencyIds.end()) return it->second;
+    int id = static_cast<int>(currencies.size());
+    currencies.push_back(code);
+    ccyBal.push_back(vector<double>(names.size(), 0.0));
+    timelines.push_back(vector<Timeline>(names.size()));
+    pairs.push_back(PairTable());
+    categoryTotals.push_back(vector<Rollup>(categories.size()));
+    userRollups.push_back(unordered_map<uint64_t,Rollup>());
+    rates.push_back(0.0);
+    currencyIds[code] = id;
+    return id;
+}
+
+int Book::findCurrency(const string& code) const {
+    if (code.empty()) return 0;
+    unordered_map<string,int>::const_iterator it = currencyIds.find(code);
+    return it == currencyIds.end() ? -1 : it->second;
+}
+
+void Book::adjustBalance(size_t u, int currency, double delta){
+    if (currency == 0) adjustBalance(u, delta);
+    else ccyBal[currency][u] += delta;
+}
+
+uint64_t Book::rollupKey(int category, size_t user){
+    return (static_cast<uint64_t>(category) << 32) | static_cast<uint64_t>(user);
+}
+
+void Book::rollupExpense(const Expense& e, size_t payer, double sign, bool totals){
+    rollupExpense(e, payer, resolveShares(e), sign, totals);
+}
+
+void Book::rollupExpense(const Expense& e, size_t payer, const vector<pair<size_t,double>>& parts, double sign,
+                   bool totals){
+    long long n = llround(sign);
+    if (totals){
+        Rollup& t = categoryTotals[e.currency][e.category];
+        t.count += n; t.paid += sign * e.amount;
+    }
+    unordered_map<uint64_t,Rollup>& rollups = userRollups[e.currency];
+    Rollup& p = rollups[rollupKey(e.category, payer)];
+    p.count += n; p.paid += sign * e.amount;
+    for (size_t i=0;i<parts.size();++i){
+        size_t u = parts[i].first;
+        Rollup& r = rollups[rollupKey(e.category, u)];
+        if (u != payer) r.count += n;
+        r.share += sign * parts[i].second;
+    }
+}
+
+const vector<pair<size_t,double>>& Book::resolveShares(const Expense& e) const {
+    shareIds.clear();
+    for (ShareMap::const_iterator it = e.shares.begin(); it != e.shares.end(); ++it)
+        shareIds.push_back(make_pair(userId(it->first), it->second));
+    return shareIds;
+}
+
+void Book::indexExpense(size_t id, bool summarized){
+    const Expense& e = expenses[id];
+    indexExpense(id, userId(e.payer), resolveShares(e), summarized);
+}
+
+void Book::indexExpense(size_t id, size_t payer, const vector<pair<size_t,double>>& parts, bool summarized){
+    const Expense& e = expenses[id];
+    if (!summarized){
+        adjustBalance(payer, e.currency, e.amount);
+        for (size_t i=0;i<parts.size();++i) adjustBalance(parts[i].first, e.currency, -parts[i].second);
+        if (balancesOnly){ unindexed.push_back(id); return; }
+    }
+    indexSecondary(id, payer, parts, summarized);
+}
+
+void Book::indexSecondary(size_t id, size_t payer, const vector<pair<size_t,double>>& parts, bool summarized){
+    const Expense& e = expenses[id];
+    vector<Timeline>& tl = timelines[e.currency];
+    tl[payer].add(e.day, e.amount);
+    postings[payer].push_back(id);
+    amountPending.push_back(id);
+    indexNote(e, id);
+    groupExpense(e, 1.0);
+    ++groupExpenses[e.group];
+    if (e.importHash) imported.insert(e.importHash);
+    rollupExpense(e, payer, parts, 1.0, !summarized);
+    for (size_t i=0;i<parts.size();++i){
+        size_t u = parts[i].first;
+        double s = parts[i].second;
+        tl[u].add(e.day, -s);
+        if (u != payer){
+            postings[u].push_back(id);
+            if (!summarized) pairs[e.currency].add(u, payer, s);
+        }
+    }
+}
+
+void Book::unindexExpense(size_t id){
+    catchUpIndexes();
+    const Expense& e = expenses[id];
+    size_t payer = userId(e.payer);
+    vector<Timeline>& tl = timelines[e.currency];
+    tl[payer].add(e.day, -e.amount);
+    flushAmountIndex();
+    byAmount.erase(make_pair(e.amount, id));
+    byPayerAmount.erase(make_tuple(payer, e.amount, id));
+    groupExpense(e, -1.0);
+    --groupExpenses[e.group];
+    if (e.importHash) imported.erase(e.importHash);
+    adjustBalance(payer, e.currency, -e.amount);
+    rollupExpense(e, payer, -1.0);
+    for (ShareMap::const_iterator it = e.shares.begin(); it != e.shares.end(); ++it){
+        size_t u = userId(it->first);
+        tl[u].add(e.day, it->second);
+        adjustBalance(u, e.currency, it->second);
+        if (u != payer){
+            pairs[e.currency].add(u, payer, -it->second);
+            markStale(u);
+        }
+    }
+    markStale(payer);
+}
+
+void Book::catchUpIndexes(){
+    if (unindexed.empty()) return;
+    vector<size_t> ids;
+    ids.swap(unindexed);
+    for (size_t i=0;i<ids.size();++i){
+        if (!isLive(ids[i])) continue;
+        const Expense& e = expenses[ids[i]];
+        indexSecondary(ids[i], userId(e.payer), resolveShares(e), false);
+    }
+}
+
+void Book::flushAmountIndex() const {
+    if (amountPending.empty()) return;
+    vector<pair<double,size_t>> a;
+    vector<tuple<size_t,double,size_t>> p;
+    a.reserve(amountPending.size());
+    p.reserve(amountPending.size());
+    for (size_t i=0;i<amountPending.size();++i){
+        size_t id = amountPending[i];
+        if (!isLive(id)) continue;
+        const Expense& e = expenses[id];
+        a.push_back(make_pair(e.amount, id));
+        p.push_back(make_tuple(userId(e.payer), e.amount, id));
+    }
+    amountPending.clear();
+    sort(a.begin(), a.end());
+    sort(p.begin(), p.end());
+    set<pair<double,size_t>>::iterator ha = byAmount.end();
+    for (size_t i=0;i<a.size();++i) ha = next(byAmount.insert(ha, a[i]));
+    set<tuple<size_t,double,size_t>>::iterator hp = byPayerAmount.end();
+    for (size_t i=0;i<p.size();++i) hp = next(byPayerAmount.insert(hp, p[i]));
+}
+
+void Book::markStale(size_t u){
+    if (postingGarbage.size() <= u) postingGarbage.resize(names.size(), 0);
+    if (staleMark.size() <= u) staleMark.resize(names.size(), 0);
+    size_t g = ++postingGarbage[u];
+    if (staleMark[u] || u == compactUser || g < 8 || g * 4 < postings[u].size()) return;
+    staleMark[u] = 1;
+    staleUsers.push_back(u);
+}
+
+void Book::compactStep(size_t budget){
+    while (budget > 0){
+        if (compactUser == NO_USER){
+            if (staleUsers.empty()) return;
+            compactUser = staleUsers.back();
+            staleUsers.pop_back();
+            staleMark[compactUser] = 0;
+            if (compactUser >= names.size()){ compactUser = NO_USER; continue; }   // removed by undo of add-user
+            postingGarbage[compactUser] = 0;
+            compactRead = compactWrite = compactClear = 0;
+            if (compactSeen.size() < expenses.size()) compactSeen.resize(expenses.size(), 0);
+        }
+        size_t u = compactUser;
+        vector<size_t>& p = postings[u];
+        if (compactRead < p.size()){
+            // filter: keep the first live entry of each expense u is still in
+            for (; compactRead < p.size() && budget > 0; --budget){
+                size_t id = p[compactRead++];
+                if (!isLive(id)) continue;
+                if (compactSeen.size() <= id) compactSeen.resize(expenses.size(), 0);
+                if (compactSeen[id]) continue;
+                const Expense& e = expenses[id];
+                if (e.payer != names[u] && e.shares.count(names[u]) == 0) continue;
+                compactSeen[id] = 1;
+                p[compactWrite++] = id;
+            }
+            if (compactRead == p.size()){ p.resize(compactWrite); compactRead = compactWrite; }
+        } else if (compactClear < compactWrite){
+            // reset the marks of the kept ids for the next pass
+            for (; compactClear < compactWrite && budget > 0; --budget) compactSeen[p[compactClear++]] = 0;
+        } else {
+            compactUser = NO_USER;
+        }
+    }
+}
+
+void Book::applyRule(size_t r, long long times){
+    if (times == 0) return;
+    RecurringRule& rule = rules[r];
+    const Expense& e = rule.e;
+    double k = static_cast<double>(times);
+    size_t payer = userId(e.payer);
+    adjustBalance(payer, e.currency, k * e.amount);
+    rollupExpense(e, payer, k);
+    groupExpense(e, k);
+    for (ShareMap::const_iterator it = e.shares.begin(); it != e.shares.end(); ++it){
+        size_t u = userId(it->first);
+        adjustBalance(u, e.currency, -k * it->second);
+        if (u != payer) pairs[e.currency].add(u, payer, k * it->second);
+    }
+    rule.applied += times;
+}
+
+void Book::refreshRecurring(int day){
+    today = day;
+    for (size_t r=0;r<rules.size();++r){
+        long long due = rules[r].through(day);
+        if (due != rules[r].applied) applyRule(r, due - rules[r].applied);
+    }
+}
+
+void Book::addRecurring(const RecurringRule& r){
+    TraceSpan span("apply");
+    rules.push_back(r);
+    rules.back().applied = 0;
+    ++groupExpenses[r.e.group];
+    applyRule(rules.size()-1, rules.back().through(today));
+    logMutation(Mutation::ADD_RULE, rules.size()-1);
+}
+
+bool Book::endRecurring(size_t r, int day, string& err){
+    if (r >= rules.size()){ err = "No such rule: r" + to_string(r); return false; }
+    long long n = rules[r].through(day);
+    if (n >= rules[r].count){ err = "Rule r" + to_string(r) + " has no occurrences after " + formatDate(day) + "."; return false; }
+    undoCounts.push_back(rules[r].count);
+    setRuleCount(r, n);
+    logMutation(Mutation::END_RULE, r);
+    return true;
+}
+
+void Book::setRuleCount(size_t r, long long count){
+    rules[r].count = count;
+    applyRule(r, rules[r].through(today) - rules[r].applied);
+}
+
+void Book::applyTransfer(const Transfer& t, double sign){
+    double amt = sign * t.amount;
+    timelines[t.currency][t.from].add(t.day, amt);
+    timelines[t.currency][t.to].add(t.day, -amt);
+    adjustBalance(t.from, t.currency, amt);
+    adjustBalance(t.to, t.currency, -amt);
+    pairs[t.currency].add(t.from, t.to, -amt);
+}
+
+void Book::recordPayment(const Transfer& t){
+    TraceSpan span("apply");
+    transfers.push_back(t);
+    applyTransfer(t, 1.0);
+    logMutation(Mutation::PAYMENT, transfers.size()-1);
+}
+
+bool Book::knownImport(uint64_t h) const {
+    return imported.contains(h) || (batch.open && batch.hashes.contains(h));
+}
+
+bool Book::commitBatch(string& err, uint64_t seq){
+    if (!seq) seq = journalSeq + 1;
+    if (!journalPath.empty() && !appendJournal(seq, err)) return false;
+    journalSeq = seq;
+    TraceSpan span("apply");
+    expenses.reserve(expenses.size() + batch.expenses.size());
+    transfers.reserve(transfers.size() + batch.transfers.size());
+    beginDeferRanked();
+    for (size_t i=0;i<batch.expenses.size();++i){
+        expenses.push_back(std::move(batch.expenses[i]));
+        indexExpense(expenses.size()-1);
+        logMutation(Mutation::ADD_EXPENSE, expenses.size()-1);
+    }
+    for (size_t i=0;i<batch.transfers.size();++i){
+        transfers.push_back(batch.transfers[i]);
+        applyTransfer(batch.transfers[i], 1.0);
+        logMutation(Mutation::PAYMENT, transfers.size()-1);
+    }
+    endDeferRanked();
+    batch.clear();
+    return true;
+}
+
+void Book::beginDeferRanked(){
+    rankedMark.assign(names.size(), 0);
+    deferRanked = true;
+}
+
+void Book::endDeferRanked(){
+    deferRanked = false;
+    for (size_t k=0;k<rankedDirty.size();++k){
+        size_t u = rankedDirty[k].first;
+        ranked.erase(make_pair(rankedDirty[k].second, u));
+        ranked.insert(make_pair(bal[u], u));
+    }
+    rankedDirty.clear();
+}
+
+void Book::setPlan(const vector<tuple<string,string,double>>& txns, int currency){
+    lastPlan.clear();
+    for (size_t i=0;i<txns.size();++i){
+        Transfer t;
+        t.from = static_cast<uint32_t>(userId(get<0>(txns[i])));
+        t.to = static_cast<uint32_t>(userId(get<1>(txns[i])));
+        t.currency = currency;
+        t.day = today;
+        t.amount = get<2>(txns[i]);
+        lastPlan.push_back(t);
+    }
+}
+
+bool Book::buildExpenseEqual(const string& payer, double amount, const vector<string>& participants,
+                       const ExpenseMeta& meta, Expense& e, string& err) const {
+    TraceSpan span("validate");
+    if (!hasUser(payer)) { err = "Unknown payer: " + payer; return false; }
+    if (participants.empty()) { err = "No participants."; return false; }
+    for (size_t i=0;i<participants.size();++i)
+        if (!hasUser(participants[i])) { err = "Unknown participant: " + participants[i]; return false; }
+
+    double share = amount / static_cast<double>(participants.size());
+    e = Expense(); e.payer = payer; e.amount = amount;
+    e.day = meta.day; e.category = meta.category; e.currency = meta.currency;
+    e.noteOff = meta.noteOff; e.noteLen = meta.noteLen; e.group = meta.group;
+    e.shares.reserve(participants.size());
+    for (size_t i=0;i<participants.size();++i) e.shares[participants[i]] += share;
+    return true;
+}
+
+bool Book::buildExpenseExact(const string& payer, double amount, const vector<string>& tokens,
+                       const ExpenseMeta& meta, Expense& e, string& err) const {
+    TraceSpan span("validate");
+    e = Expense(); e.payer = payer; e.amount = amount;
+    e.day = meta.day; e.category = meta.category; e.currency = meta.currency;
+    e.noteOff = meta.noteOff; e.noteLen = meta.noteLen; e.group = meta.group;
+    if (!hasUser(payer)) { err = "Unknown payer: " + payer; return false; }
+    if (tokens.empty()) { err = "No shares provided."; return false; }
+    e.shares.reserve(tokens.size());
+    double sumShares = 0.0;
+    for (size_t i=0;i<tokens.size();++i){
+        const string& t = tokens[i];
+        size_t pos = t.find(':');
+        if (pos==string::npos) { err = "Bad token '"+t+"', expected name:amount"; return false; }
+        string name = t.substr(0,pos), num = t.substr(pos+1);
+        char* stop = nullptr;
+        double s = strtod(num.c_str(), &stop);
+        if (num.empty() || *stop || !std::isfinite(s)) { err = "Bad share in '"+t+"', expected name:amount"; return false; }
+        if (!hasUser(name)) { err = "Unknown participant: " + name; return false; }
+        e.shares[name] += s;
+        sumShares += s;
+    }
+    if (fabs(sumShares - amount) > 0.01) {
+        err = "Share sum (" + to_string(sumShares) + ") != amount (" + to_string(amount) + ")";
+        return false;
+    }
+    return true;
+}
+
+bool Book::buildExpenseByIds(uint32_t payer, double amount, const uint32_t* ids, const double* shares, size_t n,
+                       Expense& e, string& err) const {
+    const size_t users = names.size();
+    if (payer >= users){ err = "Unknown payer id."; return false; }
+    if (n == 0){ err = "No participants."; return false; }
+    if (!std::isfinite(amount)){ err = "Bad amount."; return false; }
+    double share = amount / static_cast<double>(n), sum = 0.0;
+    shareIds.clear();
+    for (size_t i=0;i<n;++i){
+        if (ids[i] >= users){ err = "Unknown participant id."; return false; }
+        double s = shares ? shares[i] : share;
+        shareIds.push_back(make_pair(static_cast<size_t>(ids[i]), s));
+        sum += s;
+    }
+    if (shares && fabs(sum - amount) > 0.01){ err = "Share sum != amount."; return false; }
+    // Name order, as in the share map; a repeated id lands next to itself.
+    const vector<string>& nm = names;
+    sort(shareIds.begin(), shareIds.end(),
+         [&nm](const pair<size_t,double>& x, const pair<size_t,double>& y){ return nm[x.first] < nm[y.first]; });
+    size_t w = 0;
+    for (size_t i=0;i<shareIds.size();++i){
+        if (w && shareIds[w-1].first == shareIds[i].first) shareIds[w-1].second += shareIds[i].second;
+        else shareIds[w++] = shareIds[i];
+    }
+    shareIds.resize(w);
+    e = Expense(); e.payer = names[payer]; e.amount = amount;
+    e.shares.reserve(w);
+    for (size_t i=0;i<w;++i) e.shares.push(names[shareIds[i].first], shareIds[i].second);
+    return true;
+}
+
+bool Book::addExpenseByIds(uint32_t payer, double amount, const uint32_t* ids, const double* shares, size_t n,
+                     string& err){
+    Expense e;
+    if (!buildExpenseByIds(payer, amount, ids, shares, n, e, err)) return false;
+    storeExpense(std::move(e), payer, shareIds);
+    return true;
+}
+
+bool Book::prepareTemplate(const string& name, const string& payer, const vector<string>& participants,
+                     const vector<double>& weights, string& err){
+    if (!hasUser(payer)){ err = "Unknown payer: " + payer; return false; }
+    if (participants.empty()){ err = "No participants."; return false; }
+    ExpenseTemplate t;
+    t.userGeneration = userGeneration;
+    t.payer = static_cast<uint32_t>(userId(payer));
+    double total = 0.0;
+    for (size_t i=0;i<participants.size();++i){
+        if (!hasUser(participants[i])){ err = "Unknown participant: " + participants[i]; return false; }
+        t.ids.push_back(static_cast<uint32_t>(userId(participants[i])));
+        if (!weights.empty()){
+            if (!(weights[i] > 0)){ err = "Bad ratio for " + participants[i]; return false; }
+            total += weights[i];
+        }
+    }
+    for (size_t i=0;i<weights.size();++i) t.fractions.push_back(weights[i] / total);
+    // Name order, as in the share map; a repeated id lands next to itself.
+    vector<size_t> order(t.ids.size());
+    for (size_t i=0;i<order.size();++i) order[i] = i;
+    const vector<string>& nm = names;
+    const vector<uint32_t>& ids = t.ids;
+    stable_sort(order.begin(), order.end(),
+                [&nm, &ids](size_t x, size_t y){ return nm[ids[x]] < nm[ids[y]]; });
+    ExpenseTemplate sorted = t;
+    for (size_t i=0;i<order.size();++i){
+        sorted.ids[i] = t.ids[order[i]];
+        if (!t.fractions.empty()) sorted.fractions[i] = t.fractions[order[i]];
+    }
+    templates[name] = sorted;
+    return true;
+}
+
+bool Book::execTemplate(const ExpenseTemplate& t, double amount, const ExpenseMeta& meta, string& err){
+    if (t.userGeneration != userGeneration){ err = "Users changed since this split was prepared; prepare it again."; return false; }
+    if (!std::isfinite(amount)){ err = "Bad amount."; return false; }
+    // t.ids is in name order: merge repeats and fill the share map in one pass
+    double share = amount / static_cast<double>(t.ids.size());
+    shareIds.clear();
+    for (size_t i=0;i<t.ids.size();++i){
+        double s = t.fractions.empty() ? share : amount * t.fractions[i];
+        if (!shareIds.empty() && shareIds.back().first == t.ids[i]) shareIds.back().second += s;
+        else shareIds.push_back(make_pair(static_cast<size_t>(t.ids[i]), s));
+    }
+    Expense e;
+    e.payer = names[t.payer]; e.amount = amount;
+    e.shares.reserve(shareIds.size());
+    for (size_t i=0;i<shareIds.size();++i) e.shares.push(names[shareIds[i].first], shareIds[i].second);
+    e.day = meta.day; e.category = meta.category; e.currency = meta.currency;
+    e.noteOff = meta.noteOff; e.noteLen = meta.noteLen; e.group = meta.group;
+    if (batch.open) batch.stage(std::move(e));
+    else storeExpense(std::move(e), t.payer, shareIds);
+    return true;
+}
+
+void Book::storeOrStage(Expense e){
+    if (batch.open) batch.stage(std::move(e));
+    else storeExpense(std::move(e));
+}
+
+void Book::storeExpense(Expense e){
+    TraceSpan span("apply");
+    expenses.push_back(std::move(e));
+    indexExpense(expenses.size()-1);
+    logMutation(Mutation::ADD_EXPENSE, expenses.size()-1);
+}
+
+void Book::storeExpense(Expense e, size_t payer, const vector<pair<size_t,double>>& parts){
+    TraceSpan span("apply");
+    expenses.push_back(std::move(e));
+    indexExpense(expenses.size()-1, payer, parts);
+    logMutation(Mutation::ADD_EXPENSE, expenses.size()-1);
+}
+
+bool Book::addExpenseEqual(const string& payer, double amount, const vector<string>& participants, string& err,
+                     const ExpenseMeta& meta){
+    Expense e;
+    if (!buildExpenseEqual(payer, amount, participants, meta, e, err)) return false;
+    storeExpense(std::move(e));
+    return true;
+}
+
+bool Book::addExpenseExact(const string& payer, double amount, const vector<string>& tokens, string& err,
+                     const ExpenseMeta& meta){
+    Expense e;
+    if (!buildExpenseExact(payer, amount, tokens, meta, e, err)) return false;
+    storeExpense(std::move(e));
+    return true;
+}
+
+bool Book::removeExpense(size_t id, string& err, bool compact){
+    if (!isLive(id)){ err = "No such expense: #" + to_string(id); return false; }
+    if (isSealed(id)){ err = "Expense #" + to_string(id) + " is in a closed period."; return false; }
+    TraceSpan span("apply");
+    unindexExpense(id);
+    undoPayloads.push_back(std::move(expenses[id]));
+    expenses[id] = Expense();
+    expenses[id].removed = true;
+    logMutation(Mutation::REMOVE_EXPENSE, id);
+    if (compact) compactStep();
+    return true;
+}
+
+bool Book::replaceExpense(size_t id, const Expense& e, bool compact){
+    if (!isLive(id)) return false;
+    TraceSpan span("apply");
+    unindexExpense(id);
+    undoPayloads.push_back(std::move(expenses[id]));
+    expenses[id] = e;
+    indexExpense(id);
+    logMutation(Mutation::EDIT_EXPENSE, id);
+    if (compact) compactStep();
+    return true;
+}
+
+bool Book::closePeriod(const string& label, string& err){
+    for (size_t i=0;i<segments.size();++i)
+        if (segments[i].label == label){ err = "Period exists: " + label; return false; }
+    PeriodSegment seg;
+    seg.label = label; seg.first = sealedEnd; seg.end = expenses.size();
+    seg.totals.assign(currencies.size(), vector<Rollup>(categories.size()));
+    map<pair<int,size_t>,double> bals;
+    map<tuple<int,size_t,size_t>,double> owed;
+    for (size_t id=seg.first;id<seg.end;++id){
+        if (!isLive(id)) continue;
+        const Expense& e = expenses[id];
+        size_t payer = userId(e.payer);
+        bals[make_pair(e.currency, payer)] += e.amount;
+        seg.totals[e.currency][e.category].count += 1;
+        seg.totals[e.currency][e.category].paid += e.amount;
+        for (ShareMap::const_iterator it = e.shares.begin(); it != e.shares.end(); ++it){
+            size_t u = userId(it->first);
+            bals[make_pair(e.currency, u)] -= it->second;
+            if (u != payer) owed[make_tuple(e.currency, u, payer)] += it->second;
+        }
+    }
+    for (map<pair<int,size_t>,double>::const_iterator it = bals.begin(); it != bals.end(); ++it)
+        seg.deltas.push_back(PeriodSegment::Delta{it->first.second, it->first.first, it->second});
+    for (map<tuple<int,size_t,size_t>,double>::const_iterator it = owed.begin(); it != owed.end(); ++it)
+        seg.pairDeltas.push_back(PeriodSegment::PairDelta{get<1>(it->first), get<2>(it->first), get<0>(it->first), it->second});
+    segments.push_back(seg);
+    sealedEnd = seg.end;
+    undoLog.clear(); undoPayloads.clear(); undoCounts.clear(); redoStack.clear();
+    return true;
+}
+
+void Book::applySummary(const PeriodSegment& seg){
+    for (size_t i=0;i<seg.deltas.size();++i)
+        adjustBalance(seg.deltas[i].user, seg.deltas[i].currency, seg.deltas[i].amount);
+    for (size_t i=0;i<seg.pairDeltas.size();++i)
+        pairs[seg.pairDeltas[i].currency].add(seg.pairDeltas[i].from, seg.pairDeltas[i].to, seg.pairDeltas[i].amount);
+    for (size_t k=0;k<seg.totals.size();++k)
+        for (size_t c=0;c<seg.totals[k].size();++c){
+            categoryTotals[k][c].count += seg.totals[k][c].count;
+            categoryTotals[k][c].paid += seg.totals[k][c].paid;
+        }
+}
+
+bool Book::loadSegment(PeriodSegment& seg, string& err){
+    if (seg.loaded) return true;
+    TraceSpan span("load.segment");
+    ifstream in(seg.file.c_str());
+    string tag, label; size_t n = 0;
+    if (!in || !(in >> tag >> label >> n) || tag!="SEGMENT" || label!=seg.label || n != seg.end - seg.first){
+        err = "Cannot read period file " + seg.file + ".";
+        return false;
+    }
+    // parse the whole file before indexing anything, so a bad file
+    // leaves the book as it was and a retry starts clean
+    vector<Expense> read(n);
+    for (size_t k=0;k<n;++k)
+        if (!readExpenseBody(in, read[k], err)) return false;
+    for (size_t k=0;k<n;++k){
+        expenses[seg.first + k] = std::move(read[k]);
+        indexExpense(seg.first + k, true);
+    }
+    seg.loaded = true;
+    return true;
+}
+
+bool Book::loadSegments(string& err){
+    for (size_t i=0;i<segments.size();++i)
+        if (!loadSegment(segments[i], err)) return false;
+    return true;
+}
+
+map<string,double> Book::computeNet(int currency) const {
+    const vector<double>& b = balancesIn(currency);
+    map<string,double> net;
+    for (size_t i=0;i<names.size();++i)
+        // clamp tiny noise to 0
+        net[names[i]] = fabs(b[i]) < 1e-9 ? 0.0 : b[i];
+    return net;
+}
+
+bool Book::convertedNet(int target, map<string,double>& net, string& err) const {
+    if (!(rates[target] > 0)){ err = "No rate for " + currencies[target] + "."; return false; }
+    vector<double> out(names.size(), 0.0);
+    for (size_t c=0;c<currencies.size();++c){
+        const vector<double>& b = balancesIn(static_cast<int>(c));
+        if (!(rates[c] > 0)){
+            for (size_t i=0;i<b.size();++i)
+                if (b[i] != 0.0){ err = "No rate for " + (c ? currencies[c] : string("book currency")) + "."; return false; }
+            continue;
+        }
+        const double f = rates[c] / rates[target];
+        const double* src = b.data();
+        double* dst = out.data();
+        const size_t n = out.size();
+        for (size_t i=0;i<n;++i) dst[i] += f * src[i];
+    }
+    net.clear();
+    for (size_t i=0;i<names.size();++i) net[names[i]] = fabs(out[i]) < 1e-9 ? 0.0 : out[i];
+    return true;
+}
+
+vector<int> Book::activeCurrencies() const {
+    vector<int> out;
+    for (size_t c=1;c<ccyBal.size();++c)
+        for (size_t i=0;i<ccyBal[c].size();++i)
+            if (fabs(ccyBal[c][i]) > EPS){ out.push_back(static_cast<int>(c)); break; }
+    return out;
+}
+
+bool Book::loadRates(const string& path, string& err){
+    ifstream in(path.c_str());
+    if (!in){ err="Cannot open file for reading."; return false; }
+    string code; double r = 0;
+    while (in >> code >> r){
+        if (!(r > 0)){ err = "Bad rate for " + code + "."; return false; }
+        rates[internCurrency(code)] = r;
+    }
+    if (!in.eof()){ err = "Corrupt rate table."; return false; }
+    return true;
+}
+
+map<string,double> Book::balancesAsOf(int day, int currency) const {
+    map<string,double> net;
+    vector<double> v(names.size());
+    for (size_t i=0;i<names.size();++i) v[i] = timelines[currency][i].asOf(day);
+    for (size_t r=0;r<rules.size();++r){
+        const Expense& e = rules[r].e;
+        if (e.currency != currency) continue;
+        double k = static_cast<double>(rules[r].through(day));
+        v[userId(e.payer)] += k * e.amount;
+        for (ShareMap::const_iterator it = e.shares.begin(); it != e.shares.end(); ++it)
+            v[userId(it->first)] -= k * it->second;
+    }
+    for (size_t i=0;i<names.size();++i) net[names[i]] = fabs(v[i]) < 1e-9 ? 0.0 : v[i];
+    return net;
+}
+
+vector<tuple<string,string,double>> Book::settle(int currency) const {
+    map<string,double> net;
+    {
+        TraceSpan span("settle.net");
+        net = computeNet(currency);
+    }
+    return settleGreedy(net);
+}
+
+vector<vector<string>> Book::components() const {
+    vector<size_t> parent(names.size());
+    for (size_t i=0;i<parent.size();++i) parent[i] = i;
+    struct Find {
+        vector<size_t>& p;
+        size_t operator()(size_t x){ while (p[x]!=x){ p[x] = p[p[x]]; x = p[x]; } return x; }
+    } find{parent};
+
+    for (size_t i=0;i<expenses.size();++i){
+        const Expense& e = expenses[i];
+        if (e.removed) continue;
+        size_t a = find(userId(e.payer));
+        for (ShareMap::const_iterator it = e.shares.begin(); it != e.shares.end(); ++it){
+            size_t b = find(userId(it->first));
+            if (a != b){ parent[b] = a; }
+        }
+    }
+    for (size_t r=0;r<rules.size();++r){
+        const Expense& e = rules[r].e;
+        size_t a = find(userId(e.payer));
+        for (ShareMap::const_iterator it = e.shares.begin(); it != e.shares.end(); ++it){
+            size_t b = find(userId(it->first));
+            if (a != b){ parent[b] = a; }
+        }
+    }
+    for (size_t i=0;i<transfers.size();++i){
+        size_t a = find(transfers[i].from), b = find(transfers[i].to);
+        if (a != b){ parent[b] = a; }
+    }
+    map<size_t, vector<string>> byRoot;
+    for (size_t i=0;i<names.size();++i) byRoot[find(i)].push_back(names[i]);
+    vector<vector<string>> out;
+    for (map<size_t, vector<string>>::iterator it = byRoot.begin(); it != byRoot.end(); ++it) out.push_back(it->second);
+    return out;
+}
+
+vector<tuple<string,string,double>> Book::settleAuto(const vector<vector<string>>& comps, int currency,
+                                                    const SettleConfig& cfg, AutoStats& stats) const {
+    map<string,double> net;
+    {
+        TraceSpan span("settle.net");
+        net = computeNet(currency);
+    }
+    TraceSpan span("settle.auto");
+    return settleAdaptive(net, comps, cfg, stats);
+}
+
+void Book::writeExpenseBody(ostream& out, const Expense& e) const {
+    out << "PAYER " << e.payer << " AMT " << e.amount;
+    if (e.day != NO_DATE) out << " DATE " << formatDate(e.day);
+    if (e.category != 0) out << " CAT " << categories[e.category];
+    if (e.currency != 0) out << " CCY " << currencies[e.currency];
+    if (e.group != 0) out << " GRP " << groups[e.group];
+    if (e.importHash){
+        char buf[20];
+        snprintf(buf, sizeof buf, "%016llx", static_cast<unsigned long long>(e.importHash));
+        out << " IMP " << buf;
+    }
+    // length-prefixed so the text needs no escaping
+    if (e.noteLen) out << " NOTE " << e.noteLen << " ";
+    out.write(notePool.data() + e.noteOff, e.noteLen);
+    out << "\n";
+    out << "SHARES " << e.shares.size() << "\n";
+    for (ShareMap::const_iterator it=e.shares.begin(); it!=e.shares.end(); ++it)
+        out << it->first << " " << it->second << "\n";
+}
+
+void Book::writePayment(ostream& out, const Transfer& t) const {
+    out << names[t.from] << " " << names[t.to] << " " << t.amount << " " << formatDate(t.day);
+    if (t.currency != 0) out << " " << currencies[t.currency];
+    out << "\n";
+}
+
+bool Book::readPayment(const string& line, Transfer& t, string& err){
+    stringstream ls(line);
+    string from, to, date, code;
+    if (!(ls >> from >> to >> t.amount >> date) || !parseDate(date, t.day)){
+        err="Corrupt payment entry."; return false;
+    }
+    if (!hasUser(from) || !hasUser(to)){ err="Unknown user in payment: " + (hasUser(from) ? to : from); return false; }
+    ls >> code;
+    t.from = static_cast<uint32_t>(userId(from));
+    t.to = static_cast<uint32_t>(userId(to));
+    t.currency = internCurrency(code);
+    return true;
+}
+
+bool Book::appendJournal(uint64_t seq, string& err) const {
+    TraceSpan span("journal");
+    ostringstream out;
+    out.setf(std::ios::fixed); out << setprecision(2);
+    out << "BATCH " << seq << " " << batch.expenses.size() << " " << batch.transfers.size() << "\n";
+    for (size_t i=0;i<batch.expenses.size();++i) writeExpenseBody(out, batch.expenses[i]);
+    for (size_t i=0;i<batch.transfers.size();++i) writePayment(out, batch.transfers[i]);
+    out << "COMMIT\n";
+    string rec = out.str();
+    FILE* f = fopen(journalPath.c_str(), "ab");
+    if (!f){ err = "Cannot open journal " + journalPath + "."; return false; }
+    bool ok = fwrite(rec.data(), 1, rec.size(), f) == rec.size() && fflush(f) == 0 && syncFile(f);
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) err = "Cannot write journal " + journalPath + ".";
+    return ok;
+}
+
+bool Book::replayJournal(const string& path, size_t& applied, size_t& skipped, bool& torn, string& err){
+    ifstream in(path.c_str());
+    if (!in){ err="Cannot open file for reading."; return false; }
+    applied = 0; skipped = 0; torn = false;
+    string keep; keep.swap(journalPath);   // replayed records are already journaled
+    bool ok = true;
+    string tag;
+    while (ok && in >> tag){
+        uint64_t seq = 0;
+        size_t ne = 0, np = 0;
+        ok = tag=="BATCH" && static_cast<bool>(in >> seq >> ne >> np) && seq > 0;
+        if (!ok) err = "Corrupt journal record.";
+        InternMark mark = internMark();
+        batch.clear();
+        for (size_t i=0;ok && i<ne;++i){
+            Expense e;
+            ok = readExpenseBody(in, e, err);
+            if (ok) batch.stage(std::move(e));
+        }
+        string line;
+        if (ok) getline(in, line);
+        for (size_t i=0;ok && i<np;++i){
+            Transfer t;
+            ok = getline(in, line) && readPayment(line, t, err);
+            if (ok) batch.transfers.push_back(t);
+        }
+        if (ok && !(in >> tag && tag=="COMMIT")){ ok = false; err = "Corrupt journal record."; }
+        if (!ok && in.eof()){ torn = true; ok = true; break; }
+        if (ok && seq <= journalSeq){ dropInterned(mark); ++skipped; continue; }
+        if (ok) ok = commitBatch(err, seq);
+        if (ok) ++applied;
+    }
+    batch.clear();
+    journalPath.swap(keep);
+    return ok;
+}
+
+bool Book::save(const string& path, string& err){
+    for (size_t s=0;s<segments.size();++s){
+        PeriodSegment& seg = segments[s];
+        string file = path + "." + seg.label + ".seg";
+        if (seg.file == file) continue;
+        if (!loadSegment(seg, err)) return false;
+        ofstream sout(file.c_str());
+        if (!sout){ err="Cannot open " + file + " for writing."; return false; }
+        size_t live = 0;
+        for (size_t i=seg.first;i<seg.end;++i) if (!expenses[i].removed) ++live;
+        sout << "SEGMENT " << seg.label << " " << live << "\n";
+        sout.setf(std::ios::fixed); sout << setprecision(2);
+        for (size_t i=seg.first;i<seg.end;++i)
+            if (!expenses[i].removed) writeExpenseBody(sout, expenses[i]);
+        if (!sout){ err="Cannot write " + file + "."; return false; }
+        seg.file = file;
+    }
+    ofstream out(path.c_str());
+    if (!out){ err="Cannot open file for writing."; return false; }
+    out << "USERS " << names.size() << "\n";
+    for (size_t i=0;i<names.size();++i)
+        out << names[i] << "\n";
+    // optional, parents before children
+    if (groups.size() > 1){
+        out << "GROUPS " << groups.size()-1 << "\n";
+        for (size_t g=1;g<groups.size();++g)
+            out << groups[g] << " " << (groupParent[g] ? groups[groupParent[g]] : string("-")) << "\n";
+    }
+    out.setf(std::ios::fixed); out << setprecision(2);
+    // optional: closed-period summaries; their expenses are in the .seg files
+    if (!segments.empty()){
+        out << "PERIODS " << segments.size() << "\n";
+        for (size_t s=0;s<segments.size();++s){
+            const PeriodSegment& seg = segments[s];
+            size_t count = 0, cats = 0;
+            for (size_t i=seg.first;i<seg.end;++i) if (!expenses[i].removed || !seg.loaded) ++count;
+            for (size_t k=0;k<seg.totals.size();++k)
+                for (size_t c=0;c<seg.totals[k].size();++c) if (seg.totals[k][c].count) ++cats;
+            out << "PERIOD " << seg.label << " " << count << " " << seg.deltas.size() << " "
+                << seg.pairDeltas.size() << " " << cats << "\n";
+            for (size_t i=0;i<seg.deltas.size();++i)
+                out << names[seg.deltas[i].user] << " " << seg.deltas[i].amount
+                    << " " << (seg.deltas[i].currency ? currencies[seg.deltas[i].currency] : string("-")) << "\n";
+            // pair and category lines carry a currency code unless in the book currency
+            for (size_t i=0;i<seg.pairDeltas.size();++i){
+                const PeriodSegment::PairDelta& d = seg.pairDeltas[i];
+                out << names[d.from] << " " << names[d.to] << " " << d.amount;
+                if (d.currency) out << " " << currencies[d.currency];
+                out << "\n";
+            }
+            for (size_t k=0;k<seg.totals.size();++k)
+                for (size_t c=0;c<seg.totals[k].size();++c){
+                    if (!seg.totals[k][c].count) continue;
+                    out << (c ? categories[c] : string("-")) << " " << seg.totals[k][c].count << " " << seg.totals[k][c].paid;
+                    if (k) out << " " << currencies[k];
+                    out << "\n";
+                }
+        }
+    }
+    size_t live = 0;
+    for (size_t i=sealedEnd;i<expenses.size();++i) if (!expenses[i].removed) ++live;
+    out << "EXPENSES " << live << "\n";
+    for (size_t i=sealedEnd;i<expenses.size();++i){
+        if (expenses[i].removed) continue;   // tombstones are dropped; ids renumber on load
+        writeExpenseBody(out, expenses[i]);
+    }
+    // optional section, absent from files written before recurring rules
+    if (!rules.empty()){
+        out << "RECURRING " << rules.size() << "\n";
+        for (size_t i=0;i<rules.size();++i){
+            out << "RULE " << rules[i].periodName() << " COUNT " << rules[i].count << "\n";
+            writeExpenseBody(out, rules[i].e);
+        }
+    }
+    if (!transfers.empty()){
+        out << "PAYMENTS " << transfers.size() << "\n";
+        for (size_t i=0;i<transfers.size();++i) writePayment(out, transfers[i]);
+    }
+    // last committed batch: replay skips journal records up to here
+    if (journalSeq) out << "JOURNAL " << journalSeq << "\n";
+    return true;
+}
+
+bool Book::readExpenseBody(istream& in, Expense& e, string& err){
+    string tag1, tag2, payer; double amt;
+    if (!(in >> tag1 >> payer >> tag2 >> amt) || tag1 != "PAYER" || tag2 != "AMT") {
+        err = "Corrupt expense header.";
+        return false;
+    }
+    e = Expense(); e.payer = payer; e.amount = amt;
+    if (!hasUser(payer)){ err="Unknown payer in file: " + payer; return false; }
+
+    // optional attributes, then SHARES
+    string tag3; size_t m = 0;
+    if (!(in >> tag3)){ err="Corrupt shares tag."; return false; }
+    while (tag3!="SHARES"){
+        if (tag3=="NOTE"){
+            uint32_t len = 0;
+            if (!(in >> len) || in.get() != ' '){ err="Corrupt expense note."; return false; }
+            string text(len, '\0');
+            if (!in.read(&text[0], len)){ err="Corrupt expense note."; return false; }
+            internNote(text, e.noteOff, e.noteLen);
+            if (!(in >> tag3)){ err="Corrupt shares tag."; return false; }
+            continue;
+        }
+        string val;
+        if (!(in >> val)){ err="Corrupt expense attribute."; return false; }
+        if (tag3=="DATE"){ if (!parseDate(val, e.day)){ err="Corrupt expense date."; return false; } }
+        else if (tag3=="CAT") e.category = internCategory(val);
+        else if (tag3=="CCY") e.currency = internCurrency(val);
+        else if (tag3=="IMP"){
+            char* end = nullptr;
+            e.importHash = strtoull(val.c_str(), &end, 16);
+            if (val.size() != 16 || *end || e.importHash == 0){ err="Corrupt import hash."; return false; }
+        }
+        else if (tag3=="GRP"){
+            unordered_map<string,int>::const_iterator g = groupIds.find(val);
+            if (g == groupIds.end()){ err="Unknown group in file: " + val; return false; }
+            e.group = g->second;
+        }
+        else { err="Unknown expense attribute: " + tag3; return false; }
+        if (!(in >> tag3)){ err="Corrupt shares tag."; return false; }
+    }
+    if (!(in >> m)){ err="Corrupt shares tag."; return false; }
+    for (size_t i=0;i<m;++i){
+        string name; double s;
+        if (!(in >> name >> s)) { err="Corrupt share entry."; return false; }
+        if (!hasUser(name)){ err="Unknown participant in file: " + name; return false; }
+        e.shares[name]=s;
+    }
+    return true;
+}
+
+bool Book::load(const string& path, string& err){
+    ifstream in(path.c_str());
+    if (!in){ err="Cannot open file for reading."; return false; }
+    names.clear(); ids.clear(); expenses.clear(); postings.clear();
+    bal.clear(); ranked.clear(); imported.clear(); byAmount.clear(); byPayerAmount.clear(); amountPending.clear(); unindexed.clear(); undoLog.clear(); undoPayloads.clear(); undoCounts.clear(); redoStack.clear();
+    groups.assign(1, string()); groupParent.assign(1, 0); groupIds.clear();
+    groupChildren.assign(1, 0); groupExpenses.assign(1, 0); groupBal.assign(1, unordered_map<uint64_t,double>());
+    segments.clear(); sealedEnd = 0; ++userGeneration; journalSeq = 0;
+    staleUsers.clear(); staleMark.clear(); postingGarbage.clear(); compactSeen.clear(); compactUser = NO_USER; rules.clear(); notePool.clear(); trigrams.clear(); transfers.clear(); lastPlan.clear();
+    categories.assign(1, string()); categoryIds.clear();
+    // currency codes and rates are kept; only the per-currency indexes reset
+    for (size_t c=0;c<currencies.size();++c){
+        if (c) ccyBal[c].clear();
+        timelines[c].clear(); pairs[c].clear();
+        categoryTotals[c].assign(1, Rollup()); userRollups[c].clear();
+    }
+
+    string tag; size_t n = 0;
+    {
+        TraceSpan span("load.users");
+        if (!(in >> tag >> n) || tag!="USERS"){ err="Corrupt file (USERS)."; return false; }
+        in.ignore(numeric_limits<streamsize>::max(), '\n');
+        for (size_t i=0;i<n;++i){
+            string u; getline(in,u);
+            if (!u.empty() && u[u.size()-1]=='\r') u.erase(u.size()-1);   // CRLF files
+            if (u.empty()) { --i; continue; }
+            addUser(u);
+        }
+    }
+
+    {
+        TraceSpan span("load.expenses");
+        if (!(in >> tag >> n)){ err="Corrupt file (EXPENSES)."; return false; }
+        if (tag=="GROUPS"){
+            for (size_t g=0;g<n;++g){
+                string name, parent;
+                if (!(in >> name >> parent) || groupIds.count(name)
+                    || (parent!="-" && !groupIds.count(parent))){ err="Corrupt file (GROUPS)."; return false; }
+                addGroup(name, parent=="-" ? 0 : groupIds[parent]);
+            }
+            if (!(in >> tag >> n)){ err="Corrupt file (EXPENSES)."; return false; }
+        }
+        if (tag=="PERIODS"){
+            // summaries only; each period's expenses stay on disk until needed
+            for (size_t s=0;s<n;++s){
+                PeriodSegment seg;
+                size_t count = 0, nd = 0, np = 0, nc = 0;
+                if (!(in >> tag >> seg.label >> count >> nd >> np >> nc) || tag!="PERIOD"){ err="Corrupt file (PERIOD)."; return false; }
+                for (size_t i=0;i<nd;++i){
+                    string user, code; double amt;
+                    if (!(in >> user >> amt >> code) || !hasUser(user)){ err="Corrupt period balance."; return false; }
+                    seg.deltas.push_back(PeriodSegment::Delta{userId(user), code=="-" ? 0 : internCurrency(code), amt});
+                }
+                // a trailing currency code is optional (absent = book currency)
+                string code;
+                for (size_t i=0;i<np;++i){
+                    string a, b; double amt;
+                    if (!(in >> a >> b >> amt) || !hasUser(a) || !hasUser(b) || !getline(in, code)){ err="Corrupt period pair."; return false; }
+                    seg.pairDeltas.push_back(PeriodSegment::PairDelta{userId(a), userId(b), internCurrency(trimmed(code)), amt});
+                }
+                for (size_t i=0;i<nc;++i){
+                    string cat; Rollup r;
+                    if (!(in >> cat >> r.count >> r.paid) || !getline(in, code)){ err="Corrupt period totals."; return false; }
+                    size_t c = static_cast<size_t>(internCategory(cat=="-" ? string() : cat));
+                    size_t k = static_cast<size_t>(internCurrency(trimmed(code)));
+                    if (seg.totals.size() <= k) seg.totals.resize(k+1);
+                    if (seg.totals[k].size() <= c) seg.totals[k].resize(c+1);
+                    seg.totals[k][c] = r;
+                }
+                seg.first = expenses.size();
+                seg.end = seg.first + count;
+                seg.file = path + "." + seg.label + ".seg";
+                seg.loaded = false;
+                Expense hole; hole.removed = true;
+                expenses.resize(seg.end, hole);
+                applySummary(seg);
+                segments.push_back(seg);
+            }
+            sealedEnd = expenses.size();
+            if (!(in >> tag >> n)){ err="Corrupt file (EXPENSES)."; return false; }
+        }
+        if (tag!="EXPENSES"){ err="Corrupt file (EXPENSES)."; return false; }
+        for (size_t k=0;k<n;++k){
+            Expense e;
+            if (!readExpenseBody(in, e, err)) return false;
+            expenses.push_back(e);
+            indexExpense(expenses.size()-1);
+        }
+    }
+
+    // optional sections, in the order save writes them
+    bool more = static_cast<bool>(in >> tag);
+    if (more && tag=="RECURRING"){
+        TraceSpan span("load.recurring");
+        if (!(in >> n)){ err="Corrupt file (RECURRING)."; return false; }
+        for (size_t k=0;k<n;++k){
+            RecurringRule r;
+            string tag1, period, tag2;
+            if (!(in >> tag1 >> period >> tag2 >> r.count) || tag1!="RULE" || tag2!="COUNT"
+                || !parsePeriod(period, r.step, r.months) || r.count < 0){   // 0: ended before its start
+                err = "Corrupt recurring rule."; return false;
+            }
+            if (!readExpenseBody(in, r.e, err)) return false;
+            if (r.e.day == NO_DATE){ err = "Recurring rule without start DATE."; return false; }
+            rules.push_back(r);
+            ++groupExpenses[r.e.group];
+            applyRule(rules.size()-1, rules.back().through(today));
+        }
+        more = static_cast<bool>(in >> tag);
+    }
+    if (more && tag=="PAYMENTS"){
+        TraceSpan span("load.payments");
+        if (!(in >> n)){ err="Corrupt file (PAYMENTS)."; return false; }
+        transfers.reserve(n);
+        string line;
+        getline(in, line);
+        for (size_t k=0;k<n;++k){
+            Transfer t;
+            if (!getline(in, line)){ err="Corrupt payment entry."; return false; }
+            if (!readPayment(line, t, err)) return false;
+            transfers.push_back(t);
+            applyTransfer(t, 1.0);
+        }
+        more = static_cast<bool>(in >> tag);
+    }
+    if (more && tag=="JOURNAL"){
+        if (!(in >> journalSeq)){ err="Corrupt file (JOURNAL)."; return false; }
+        more = static_cast<bool>(in >> tag);
+    }
+    if (more){ err="Corrupt file (unknown section " + tag + ")."; return false; }
+    undoLog.clear();   // a loaded book starts a fresh history
+    return true;
+}
+
+void Workspace::open(const string& name){
+    for (size_t i=0;i<bookNames.size();++i)
+        if (bookNames[i]==name){ current = i; return; }
+    books.push_back(unique_ptr<Book>(new Book()));
+    bookNames.push_back(name);
+    dirIds.push_back(vector<size_t>());
+    aligned.push_back(1);
+    current = books.size()-1;
+}
+
+size_t Workspace::directoryId(const string& u){
+    unordered_map<string,size_t>::const_iterator it = userIds.find(u);
+    if (it != userIds.end()) return it->second;
+    userIds[u] = users.size();
+    users.push_back(u);
+    return users.size()-1;
+}
+
+void Workspace::sync(size_t b){
+    const Book& bk = *books[b];
+    vector<size_t>& m = dirIds[b];
+    size_t keep = 0;
+    while (keep < m.size() && keep < bk.names.size() && users[m[keep]] == bk.names[keep]) ++keep;
+    m.resize(keep);
+    for (size_t i=keep;i<bk.names.size();++i) m.push_back(directoryId(bk.names[i]));
+    aligned[b] = 1;
+    for (size_t i=0;i<m.size() && aligned[b];++i) aligned[b] = (m[i] == i);
+}
+
+map<string, vector<double>> Workspace::globalNet(){
+    map<string, vector<double>> out;
+    for (size_t b=0;b<books.size();++b) sync(b);
+    for (size_t b=0;b<books.size();++b){
+        const Book& bk = *books[b];
+        for (size_t c=0;c<bk.currencies.size();++c){
+            const vector<double>& src = bk.balancesIn(static_cast<int>(c));
+            if (src.empty()) continue;
+            vector<double>& dst = out[bk.currencies[c]];
+            dst.resize(users.size(), 0.0);
+            const double* sp = src.data();
+            double* dp = dst.data();
+            const size_t n = src.size();
+            if (aligned[b]) for (size_t i=0;i<n;++i) dp[i] += sp[i];
+            else { const size_t* ids = dirIds[b].data(); for (size_t i=0;i<n;++i) dp[ids[i]] += sp[i]; }
+        }
+    }
+    return out;
+}
+
+map<string,double> Workspace::named(const vector<double>& v) const {
+    map<string,double> net;
+    for (size_t i=0;i<v.size();++i) net[users[i]] = fabs(v[i]) < 1e-9 ? 0.0 : v[i];
+    return net;
+}
+
+// ---- C API ----
+
+struct ledger_book {
+    Book book;
+    mutable string error;   // also set by const calls (ledger_settle)
+};
+
+static int fail(ledger_book* b, const string& err){ b->error = err; return -1; }
+
+extern "C" {
+
+ledger_book* ledger_create(void){
+    try { return new ledger_book(); } catch (...) { return nullptr; }
+}
+
+void ledger_destroy(ledger_book* b){ delete b; }
+
+const char* ledger_last_error(const ledger_book* b){ return b->error.c_str(); }
+
+int ledger_load(ledger_book* b, const char* path){
+    string err;
+    try { if (!b->book.load(path, err)) return fail(b, err); }
+    catch (const exception& ex) { return fail(b, ex.what()); }
+    return 0;
+}
+
+int ledger_save(ledger_book* b, const char* path){
+    string err;
+    try { if (!b->book.save(path, err)) return fail(b, err); }
+    catch (const exception& ex) { return fail(b, ex.what()); }
+    return 0;
+}
+
+int ledger_add_users(ledger_book* b, const char* const* names, size_t n, uint32_t* ids){
+    for (size_t i=0;i<n;++i)
+        if (!names[i] || !names[i][0]) return fail(b, "Empty user name at " + to_string(i) + ".");
+    try {
+        for (size_t i=0;i<n;++i){
+            b->book.addUser(names[i]);
+            if (ids) ids[i] = static_cast<uint32_t>(b->book.userId(names[i]));
+        }
+    } catch (const exception& ex) { return fail(b, ex.what()); }
+    return 0;
+}
+
+// Build every expense first so one bad item rejects the whole batch.
+static int addBatch(ledger_book* b, const ledger_expense* ex, size_t n,
+                    const uint32_t* participants, const double* shares){
+    try {
+        vector<Expense> built(n);
+        string err;
+        for (size_t i=0;i<n;++i){
+            const double* s = shares ? shares + ex[i].first : nullptr;
+            if (!b->book.buildExpenseByIds(ex[i].payer, ex[i].amount, participants + ex[i].first, s,
+                                           ex[i].count, built[i], err))
+                return fail(b, "Expense " + to_string(i) + ": " + err);
+        }
+        b->book.expenses.reserve(b->book.expenses.size() + n);
+        for (size_t i=0;i<n;++i) b->book.storeExpense(std::move(built[i]));
+    } catch (const exception& e) { return fail(b, e.what()); }
+    return 0;
+}
+
+int ledger_add_equal(ledger_book* b, const ledger_expense* ex, size_t n, const uint32_t* participants){
+    return addBatch(b, ex, n, participants, nullptr);
+}
+
+int ledger_add_exact(ledger_book* b, const ledger_expense* ex, size_t n,
+                     const uint32_t* participants, const double* shares){
+    if (!shares) return fail(b, "Exact split without shares.");
+    return addBatch(b, ex, n, participants, shares);
+}
+
+size_t ledger_user_count(const ledger_book* b){ return b->book.names.size(); }
+
+size_t ledger_balances(const ledger_book* b, double* out, size_t cap){
+    const vector<double>& bal = b->book.bal;
+    for (size_t i=0;i<bal.size() && i<cap;++i) out[i] = fabs(bal[i]) < 1e-9 ? 0.0 : bal[i];
+    return bal.size();
+}
+
+size_t ledger_settle(const ledger_book* b, ledger_transfer* out, size_t cap){
+    try {
+        vector<tuple<string,string,double>> txns = b->book.settle();
+        for (size_t i=0;i<txns.size() && i<cap;++i){
+            out[i].from = static_cast<uint32_t>(b->book.userId(get<0>(txns[i])));
+            out[i].to = static_cast<uint32_t>(b->book.userId(get<1>(txns[i])));
+            out[i].amount = get<2>(txns[i]);
+        }
+        return txns.size();
+    } catch (const exception& e) { b->error = e.what(); return LEDGER_ERROR; }
+}
+
+}
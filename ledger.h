@@ -0,0 +1,820 @@
+// Ledger engine: books, expenses, balance indexes and settlement.
+// Everything here is free of console I/O; the CLI (main.cpp) and the C API
+// (ledger_c.h) are both clients of it. Definitions live in ledger.cpp.
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include <tuple>
+#include <queue>
+#include <iosfwd>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+
+// ---- Tracing (Chrome trace event JSON, enabled with --trace <file>) ----
+// Spans are recorded as "X" (complete) events and written once at exit.
+// When tracing is off a span costs a single branch on a plain bool.
+struct Tracer {
+    struct Event { const char* name; long long ts; long long dur; unsigned tid; };
+
+    bool on = false;
+    std::string path;
+    std::vector<Event> events;
+    std::mutex lock;
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+
+    long long nowUs() const;
+
+    static unsigned threadId();
+
+    void record(const char* name, long long ts, long long dur);
+
+    bool flush(std::string& err);
+};
+
+extern Tracer g_trace;
+
+// RAII span; name must be a string literal (stored by pointer).
+struct TraceSpan {
+    const char* name;
+    long long start;
+    explicit TraceSpan(const char* n) : name(n), start(g_trace.on ? g_trace.nowUs() : 0) {}
+    ~TraceSpan(){ if (g_trace.on) g_trace.record(name, start, g_trace.nowUs() - start); }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+static const int NO_DATE = std::numeric_limits<int>::min();
+
+// Participant -> share, as a vector sorted by name: the same iteration
+// order as map<string,double>, but one allocation per expense rather than
+// one node per participant (expenses have a handful of participants and
+// there are millions of expenses).
+struct ShareMap {
+    typedef std::vector<std::pair<std::string,double>>::const_iterator const_iterator;
+    std::vector<std::pair<std::string,double>> v;
+
+    const_iterator begin() const { return v.begin(); }
+    const_iterator end() const { return v.end(); }
+    size_t size() const { return v.size(); }
+    bool empty() const { return v.empty(); }
+    void reserve(size_t n){ v.reserve(n); }
+
+    const_iterator find(const std::string& name) const;
+    size_t count(const std::string& name) const { return find(name) != v.end() ? 1 : 0; }
+
+    // Bulk fill: distinct names in ascending order.
+    void push(const std::string& name, double share){ v.push_back(std::make_pair(name, share)); }
+
+    double& operator[](const std::string& name);
+};
+
+struct Expense {
+    std::string payer;
+    double amount{};
+    // participant -> share amount (absolute currency)
+    ShareMap shares;
+    int day = NO_DATE;   // days since 1970-01-01, NO_DATE if undated
+    int category = 0;    // index into Book::categories, 0 = uncategorized
+    int currency = 0;    // index into Book::currencies, 0 = book currency
+    uint32_t noteOff = 0, noteLen = 0;   // slice of Book::notePool, noteLen 0 = no note
+    int group = 0;       // leaf of the group tree, 0 = no group
+    uint64_t importHash = 0;   // content hash for duplicate detection, 0 = none
+    bool removed = false; // tombstone left by remove-expense
+};
+
+// Optional attributes given alongside an expense (@date, #category,
+// currency suffix on the amount, "note", %group).
+struct ExpenseMeta {
+    int day = NO_DATE;
+    int category = 0;
+    int currency = 0;
+    uint32_t noteOff = 0, noteLen = 0;
+    int group = 0;
+};
+
+// Sizes of the note pool and category dictionary before a line is parsed;
+// a line that is then rejected or skipped as a duplicate gives back what
+// it interned (see Book::dropInterned).
+struct InternMark {
+    size_t notes = 0, categories = 0;
+};
+
+// Running counters for one category, or one (category, user) pair.
+struct Rollup {
+    size_t count = 0;
+    double paid = 0.0;    // amounts paid (category totals: amount spent)
+    double share = 0.0;   // shares owed
+};
+
+static constexpr double EPS = 1e-6;
+
+// Days since 1970-01-01 <-> civil date (proleptic Gregorian).
+int daysFromCivil(int y, int m, int d);
+
+void civilFromDays(int day, int& y, int& m, int& d);
+
+int daysInMonth(int y, int m);
+
+// Today's date in days since the epoch (UTC).
+inline int todayDays(){ return static_cast<int>(time(nullptr) / 86400); }
+
+// YYYY-MM-DD checked against the month's length (February has 29 days
+// only in leap years).
+bool parseDate(const std::string& s, int& day);
+
+// 's' without leading and trailing blanks (spaces, tabs, CR).
+std::string trimmed(const std::string& s);
+
+std::string formatDate(int day);
+
+// One user's running balance over time, ordered by day (undated entries
+// sort first as NO_DATE). Appends in date order go straight into the
+// running sums, O(1). A back-dated entry waits in 'pending' until the next
+// asOf(), which sorts the waiting entries and merges them in one pass,
+// O(P log P + N); loading a book in any date order is O(N log N).
+struct Timeline {
+    mutable std::vector<int> days;
+    mutable std::vector<double> cum;   // balance at the end of days[i]
+    mutable std::vector<std::pair<int,double>> pending;   // (day, delta) not yet in cum
+
+    void add(int day, double delta);
+
+    // Balance including every entry dated on or before 'day'.
+    double asOf(int day) const;
+
+    void merge() const;
+};
+
+// ---- Settlement engines ----
+// An engine turns net balances (+ve receive, -ve pay) into transfers
+// (from, to, amount). Engines are registered in settleEngines() so the
+// benchmark can compare them against the default greedy.
+typedef std::vector<std::tuple<std::string,std::string,double>> (*SettleFn)(const std::map<std::string,double>& net);
+
+// Bytes held by the engines' working containers, for the benchmark's
+// peak-heap column. Counted only while 'on' is set; the containers are
+// local to one engine call, so they are freed before it is cleared.
+struct EngineHeap {
+    bool on = false;
+    long long cur = 0, peak = 0;
+    void add(long long n);
+};
+extern EngineHeap g_engineHeap;
+
+// std::allocator that reports to g_engineHeap.
+template<class T>
+struct CountingAlloc {
+    typedef T value_type;
+    CountingAlloc() = default;
+    template<class U> CountingAlloc(const CountingAlloc<U>&) {}
+    T* allocate(size_t n){
+        T* p = std::allocator<T>().allocate(n);
+        g_engineHeap.add(static_cast<long long>(n * sizeof(T)));
+        return p;
+    }
+    void deallocate(T* p, size_t n){
+        g_engineHeap.add(-static_cast<long long>(n * sizeof(T)));
+        std::allocator<T>().deallocate(p, n);
+    }
+};
+template<class T, class U> bool operator==(const CountingAlloc<T>&, const CountingAlloc<U>&){ return true; }
+template<class T, class U> bool operator!=(const CountingAlloc<T>&, const CountingAlloc<U>&){ return false; }
+
+template<class T> using EngineVec = std::vector<T, CountingAlloc<T>>;
+template<class K, class V> using EngineMap = std::map<K, V, std::less<K>, CountingAlloc<std::pair<const K, V>>>;
+
+struct SettleEngine {
+    const char* name;
+    SettleFn run;
+    size_t maxN;   // largest non-zero count the engine accepts (0 = no limit)
+};
+
+// Greedy min-cash-flow: repeatedly match the largest creditor with the
+// largest debtor using two heaps. 'Net' is any name -> balance map, so the
+// other engines can pass their own working maps.
+template<class Net>
+std::vector<std::tuple<std::string,std::string,double>> settleGreedyOver(const Net& net){
+    TraceSpan span("settle.heap");
+    struct Node { std::string name; double amt; }; // amt>0 creditor; amt<0 debtor
+    EngineVec<Node> cred, debt;
+    for (typename Net::const_iterator it = net.begin(); it != net.end(); ++it) {
+        const std::string& u = it->first;
+        double amt = it->second;
+        if (amt > EPS) cred.push_back(Node{u, amt});
+        else if (amt < -EPS) debt.push_back(Node{u, amt});
+    }
+
+    // priority queues (max creditor, most negative debtor)
+    struct CmpCred { bool operator()(const Node& a, const Node& b) const { return a.amt < b.amt; } }; // max-heap
+    struct CmpDebt { bool operator()(const Node& a, const Node& b) const { return a.amt > b.amt; } }; // min (most negative) first
+    std::priority_queue<Node, EngineVec<Node>, CmpCred> C(cred.begin(), cred.end());
+    std::priority_queue<Node, EngineVec<Node>, CmpDebt> D(debt.begin(), debt.end());
+
+    std::vector<std::tuple<std::string,std::string,double>> txns;
+    while (!C.empty() && !D.empty()){
+        Node c = C.top(); C.pop();
+        Node d = D.top(); D.pop();
+        double pay = std::min(c.amt, -d.amt);
+        if (pay > EPS) txns.push_back(std::make_tuple(d.name, c.name, pay));
+        c.amt -= pay;
+        d.amt += pay;
+
+        if (c.amt > EPS) C.push(c);
+        if (d.amt < -EPS) D.push(d);
+    }
+    return txns;
+}
+
+std::vector<std::tuple<std::string,std::string,double>> settleGreedy(const std::map<std::string,double>& net);
+
+// Greedy after first cancelling exact opposite pairs (a debtor owing
+// exactly what a creditor is owed settles in one transfer). Amounts match
+// to the cent; the sub-cent difference of a match stays with whichever
+// side is larger and goes through the greedy pass with the rest.
+std::vector<std::tuple<std::string,std::string,double>> settlePairsGreedy(const std::map<std::string,double>& net);
+
+// Exact minimum-transfer settlement (LeetCode 465). The optimum is
+// n - k where k is the largest number of disjoint zero-sum subsets; a DP
+// over subsets finds k, and each subset then settles greedily with
+// size-1 transfers. Subsets are zero-sum to the cent; a sub-cent residual
+// is carried into the next subset rather than dropped. Exponential, so
+// only for small groups.
+static const size_t EXACT_HARD_MAX = 22;
+
+std::vector<std::tuple<std::string,std::string,double>> settleExact(const std::map<std::string,double>& net);
+
+// Thresholds for 'settle auto', written by 'calibrate' to SETTLE_CFG_PATH.
+struct SettleConfig {
+    size_t exactMax = 12;      // largest component solved exactly
+    double budgetMs = 50.0;    // latency budget the calibration targets
+    double pairShare = 0.10;   // duplicate-amount share that enables pairing
+
+    bool save(const std::string& path, std::string& err) const;
+
+    // Missing file keeps the defaults; unknown keys are ignored.
+    void load(const std::string& path);
+};
+
+constexpr const char* SETTLE_CFG_PATH = "settle.cfg";
+extern SettleConfig g_settleCfg;
+
+struct AutoStats { size_t exact = 0, paired = 0, greedy = 0; };
+
+// Pick an engine per connected component: exact when the component is
+// small enough for the calibrated budget, pairs-first greedy when many
+// balances share an amount, plain greedy otherwise.
+std::vector<std::tuple<std::string,std::string,double>> settleAdaptive(const std::map<std::string,double>& net,
+        const std::vector<std::vector<std::string>>& components, const SettleConfig& cfg, AutoStats& stats);
+
+// Registry form of 'settle auto': the whole vector is one component.
+std::vector<std::tuple<std::string,std::string,double>> settleAuto(const std::map<std::string,double>& net);
+
+const std::vector<SettleEngine>& settleEngines();
+
+// Direct obligations between user pairs, stored as an open-addressing
+// hash table of (lo id, hi id) -> amount lo owes hi (negative: hi owes lo).
+// 16 bytes per slot, linear probing, grown at 70% load.
+struct PairTable {
+    static constexpr uint64_t EMPTY = ~static_cast<uint64_t>(0);
+    std::vector<uint64_t> keys;
+    std::vector<double> vals;
+    size_t used = 0;
+
+    static uint64_t key(size_t lo, size_t hi){ return (static_cast<uint64_t>(lo) << 32) | static_cast<uint64_t>(hi); }
+    static size_t hash(uint64_t k);
+
+    void clear(){ keys.clear(); vals.clear(); used = 0; }
+    size_t size() const { return used; }
+
+    // 'from' owes 'to' an extra 'amt' (ids must differ).
+    void add(size_t from, size_t to, double amt);
+
+    // Net amount 'from' owes 'to'; negative when 'to' owes 'from'.
+    double owed(size_t from, size_t to) const;
+
+    void grow();
+};
+
+// Set of non-zero 64-bit content hashes: open addressing, 8 bytes per
+// slot, linear probing, grown at 70% load; erase shifts later entries back
+// so no tombstones are needed.
+struct FingerprintSet {
+    std::vector<uint64_t> keys;
+    size_t used = 0;
+
+    void clear(){ keys.clear(); used = 0; }
+    size_t size() const { return used; }
+
+    bool contains(uint64_t k) const;
+
+    void insert(uint64_t k);
+
+    void erase(uint64_t k);
+
+    void grow();
+};
+
+// A recurring expense kept as a single rule: its balance effect is the
+// template times the occurrences so far, and individual occurrences are
+// only materialized for history.
+struct RecurringRule {
+    Expense e;              // one occurrence; e.day is the first date
+    int step = 1;           // period length, in months or days
+    bool months = false;
+    long long count = 0;    // total occurrences
+    long long applied = 0;  // occurrences folded into the book's indexes
+
+    // Date of occurrence i (0-based); monthly dates clamp to month end.
+    int occurrence(long long i) const;
+
+    // Number of occurrences dated on or before 'day'.
+    long long through(int day) const;
+
+    std::string periodName() const;
+};
+
+// daily | weekly | monthly | yearly | <n>d | <n>m
+bool parsePeriod(const std::string& s, int& step, bool& months);
+
+// A recorded payment: 'from' handed 'to' an amount. Kept as a flat
+// 24-byte record instead of an Expense with a share map.
+struct Transfer {
+    uint32_t from, to;
+    int32_t currency;
+    int32_t day;
+    double amount;
+};
+
+static const size_t NO_USER = std::numeric_limits<size_t>::max();
+
+// A split compiled once by 'prepare': user ids and each participant's
+// fraction of the amount (empty for an equal split), sorted by name as the
+// share map is, so exec neither sorts nor looks anything up.
+struct ExpenseTemplate {
+    uint64_t userGeneration = 0;   // Book::userGeneration when prepared
+    uint32_t payer = 0;
+    std::vector<uint32_t> ids;
+    std::vector<double> fractions;
+};
+
+// Operations staged between 'begin' and 'commit'. Each is validated when
+// staged (users cannot change inside a batch, so that is final) and the
+// lot is applied by Book::commitBatch.
+struct PendingBatch {
+    bool open = false;
+    size_t errors = 0;        // lines rejected while staging; commit refuses the batch
+    size_t skipped = 0;       // duplicates dropped by ^ref / import
+    std::vector<Expense> expenses;
+    std::vector<Transfer> transfers;
+    FingerprintSet hashes;    // importHash of staged expenses
+
+    size_t size() const { return expenses.size() + transfers.size(); }
+    void stage(Expense e);
+    void clear();
+};
+
+// Flush a stdio stream's data to the device.
+bool syncFile(FILE* f);
+
+// A closed period: expense ids [first, end) are sealed, and their effect
+// on balances, pair debts and category totals is kept as a summary so a
+// load can apply it without reading the expenses (kept in 'file').
+struct PeriodSegment {
+    struct Delta { size_t user; int currency; double amount; };
+    struct PairDelta { size_t from, to; int currency; double amount; };
+    std::string label;
+    size_t first = 0, end = 0;
+    std::string file;          // segment file the expenses can be read from, "" = memory only
+    bool loaded = true;   // expenses are in Book::expenses and fully indexed
+    std::vector<Delta> deltas;
+    std::vector<PairDelta> pairDeltas;
+    std::vector<std::vector<Rollup>> totals;   // [currency id][category id]
+};
+
+// One entry of the undo log. Mutations are undone strictly LIFO, so an
+// entry only needs the id it touched; payloads it replaced live on
+// Book::undoPayloads, and undone work moves to the redo stack.
+struct Mutation {
+    enum Kind { ADD_USER, ADD_EXPENSE, REMOVE_EXPENSE, EDIT_EXPENSE, ADD_RULE, PAYMENT, ADD_GROUP, END_RULE } kind;
+    size_t id;
+};
+
+struct Undone {
+    Mutation::Kind kind;
+    size_t id;
+    std::string name;      // ADD_USER, ADD_GROUP
+    int parent = 0;   // ADD_GROUP
+    Expense expense;  // ADD_EXPENSE, EDIT_EXPENSE (the version to re-apply)
+    RecurringRule rule; // ADD_RULE, END_RULE (count = the shortened count)
+    Transfer transfer;  // PAYMENT
+};
+
+struct Book {
+    std::vector<std::string> names;               // user id -> name, in insertion order
+    std::unordered_map<std::string,size_t> ids;   // name -> user id
+    std::vector<Expense> expenses;           // removed ones stay as tombstones so ids are stable
+    std::vector<std::vector<Timeline>> timelines = std::vector<std::vector<Timeline>>(1);   // [currency id][user id], for as-of queries
+    std::vector<std::vector<size_t>> postings;    // per user id, expense ids they paid or share in (may hold stale ids)
+    std::vector<PairTable> pairs = std::vector<PairTable>(1);   // per currency id: direct debts between payer and participants
+    std::vector<double> bal;                 // per user id, net balance in the book currency (+ve receive)
+    std::set<std::pair<double,size_t>> ranked;    // (bal, user id), ordered for top-k queries
+    mutable std::set<std::pair<double,size_t>> byAmount;  // (amount, expense id) of live expenses, for range queries
+    mutable std::set<std::tuple<size_t,double,size_t>> byPayerAmount;   // (payer id, amount, expense id)
+    mutable std::vector<size_t> amountPending;   // expense ids indexed since the last flushAmountIndex()
+    bool balancesOnly = false;          // set by the binary protocol: new expenses update balances only
+    std::vector<size_t> unindexed;           // expense ids stored while balancesOnly, see catchUpIndexes()
+    std::vector<std::string> categories = std::vector<std::string>(1);     // category id -> name ("" = none)
+    std::unordered_map<std::string,int> categoryIds;
+    std::vector<std::vector<Rollup>> categoryTotals = std::vector<std::vector<Rollup>>(1, std::vector<Rollup>(1));  // [currency id][category id]
+    std::vector<std::unordered_map<uint64_t,Rollup>> userRollups = std::vector<std::unordered_map<uint64_t,Rollup>>(1);  // per currency id: (category id << 32 | user id)
+    std::vector<std::string> currencies = std::vector<std::string>(1);     // currency id -> code ("" = book currency)
+    std::unordered_map<std::string,int> currencyIds;
+    std::vector<std::vector<double>> ccyBal = std::vector<std::vector<double>>(1);  // [currency id][user id], id 0 unused (see bal)
+    std::vector<double> rates = std::vector<double>(1, 1.0);     // book-currency value of one unit, 0 = unknown
+    std::vector<Mutation> undoLog;
+    std::vector<Expense> undoPayloads;       // prior versions for REMOVE/EDIT entries, LIFO with undoLog
+    std::vector<long long> undoCounts;       // prior rule counts for END_RULE entries, LIFO with undoLog
+    std::vector<Undone> redoStack;
+    std::vector<size_t> staleUsers;          // users whose posting lists are due for compactStep()
+    std::vector<char> staleMark;             // per user id: queued in staleUsers
+    std::vector<size_t> postingGarbage;      // per user id: posting entries left dead by unindexExpense()
+    std::vector<char> compactSeen;           // per expense id: kept by the compaction pass in progress
+    size_t compactUser = NO_USER;       // posting list being compacted, NO_USER = none
+    size_t compactRead = 0, compactWrite = 0, compactClear = 0;   // its cursors
+    std::vector<RecurringRule> rules;        // recurring expenses, folded in up to 'today'
+    std::vector<std::string> groups = std::vector<std::string>(1);   // group id -> name ("" = no group)
+    std::vector<int> groupParent = std::vector<int>(1, 0); // 0 for top-level groups
+    std::unordered_map<std::string,int> groupIds;
+    std::vector<size_t> groupChildren = std::vector<size_t>(1), groupExpenses = std::vector<size_t>(1);
+    std::vector<std::unordered_map<uint64_t,double>> groupBal = std::vector<std::unordered_map<uint64_t,double>>(1);  // per node: currencyKey -> balance of its subtree
+    FingerprintSet imported;            // importHash of every indexed expense that has one
+    std::vector<PeriodSegment> segments;     // closed periods, oldest first
+    size_t sealedEnd = 0;               // expenses below this id are sealed
+    std::string notePool;                    // every note's text back to back; append-only until load
+    std::unordered_map<uint32_t, std::vector<size_t>> trigrams;   // lowercased trigram -> expense ids (may hold stale ids)
+    int today = todayDays();
+    std::vector<Transfer> transfers;         // recorded payments, in order
+    std::vector<Transfer> lastPlan;          // transfers printed by the last settle
+    std::unordered_map<std::string,ExpenseTemplate> templates;   // prepared splits (session only, not saved)
+    uint64_t userGeneration = 0;        // bumped whenever a user id may come to mean someone else
+    mutable std::vector<std::pair<size_t,double>> shareIds;   // resolveShares() result
+    PendingBatch batch;                 // open between 'begin' and 'commit'/'rollback'
+    std::string journalPath;                 // committed batches are appended here, "" = off
+    uint64_t journalSeq = 0;            // sequence number of the last committed batch (saved with the book)
+    bool deferRanked = false;           // set by commitBatch: 'ranked' is fixed up once at the end
+    std::vector<std::pair<size_t,double>> rankedDirty;   // (user id, balance before the batch)
+    std::vector<char> rankedMark;
+
+    bool hasUser(const std::string& u) const { return ids.count(u) != 0; }
+    size_t userId(const std::string& u) const { return ids.find(u)->second; }
+    void addUser(const std::string& u);
+
+    bool isLive(size_t id) const { return id < expenses.size() && !expenses[id].removed; }
+
+    void logMutation(Mutation::Kind kind, size_t id);
+
+    // Reverse the last mutation; cost is the size of that mutation. Undo
+    // and redo leave dead posting entries for later compactStep() calls.
+    bool undo(std::string& what, std::string& err);
+
+    bool redo(std::string& what, std::string& err);
+
+    // Every balance change goes through here to keep 'ranked' in step, O(log U).
+    void adjustBalance(size_t u, double delta);
+
+    // New group node under 'parent' (0 = top level). Only leaves hold
+    // expenses, so a group that already has some cannot get children.
+    int addGroup(const std::string& name, int parent);
+
+    // Push an expense's balance deltas (times 'sign') from its leaf up to
+    // the root, O(depth * participants).
+    void groupExpense(const Expense& e, double sign);
+
+    static uint64_t currencyKey(int currency, size_t user);
+
+    // Balances in one currency of everyone with expenses in it under
+    // group g, O(members); empty when the group has none in that currency.
+    std::map<std::string,double> groupNet(int g, int currency = 0) const;
+
+    // FNV-1a over what makes two rows the same expense: payer, amount and
+    // shares in cents, currency, date and the external id if the source
+    // has one. Names rather than ids, so hashes survive save/load.
+    uint64_t contentHash(const Expense& e, const std::string& ref) const;
+
+    // Same hash from a parsed row that was never built into an Expense:
+    // 'shares' must be merged and in name order, as the share map is.
+    uint64_t contentHash(std::string_view payer, double amount, int currency, int day,
+                         const std::vector<std::pair<std::string_view,double>>& shares, std::string_view ref) const;
+
+    // Append a note to the pool; returns its (offset, length) slice.
+    void internNote(const std::string& text, uint32_t& off, uint32_t& len);
+
+    std::string noteOf(const Expense& e) const { return notePool.substr(e.noteOff, e.noteLen); }
+
+    static uint32_t trigramKey(const char* p);
+
+    void indexNote(const Expense& e, size_t id);
+
+    // Live expenses whose note contains 'text' (case-insensitive), in id
+    // order. Candidates come from the rarest trigram of the query; queries
+    // shorter than a trigram fall back to scanning every note.
+    std::vector<size_t> search(const std::string& text) const;
+
+    // Live expenses with lo <= amount <= hi in amount order, optionally
+    // only those paid by one user. O(log E + output).
+    std::vector<size_t> expensesInRange(double lo, double hi, size_t payer = NO_USER) const;
+
+    // Up to k users with the largest debts (debtors) or credits, O(k).
+    std::vector<size_t> top(size_t k, bool debtors) const;
+
+    // Dictionary-encode a category name; "" is the uncategorized id 0.
+    int internCategory(const std::string& name);
+
+    InternMark internMark() const;
+
+    // Undo interning done since 'm' by a line that stored nothing.
+    void dropInterned(const InternMark& m);
+
+    // Dictionary-encode a currency code; "" is the book currency id 0.
+    // Every per-currency index gets its row here.
+    int internCurrency(const std::string& code);
+
+    // Id of a known currency code without adding it; -1 if unknown.
+    int findCurrency(const std::string& code) const;
+
+    // Balance change in an expense's own currency.
+    void adjustBalance(size_t u, int currency, double delta);
+
+    const std::vector<double>& balancesIn(int currency) const { return currency ? ccyBal[currency] : bal; }
+
+    static uint64_t rollupKey(int category, size_t user);
+
+    // Add (sign=+1) or retract (sign=-1) an expense from the category
+    // rollups of its currency.
+    // 'sign' may be a multiple for recurring rules (occurrence count).
+    // totals=false skips the book-wide totals (already applied from a
+    // period summary).
+    void rollupExpense(const Expense& e, size_t payer, double sign, bool totals = true);
+
+    void rollupExpense(const Expense& e, size_t payer, const std::vector<std::pair<size_t,double>>& parts, double sign,
+                       bool totals = true);
+
+    // (user id, share) for each participant, in share-map order; valid
+    // until the next call.
+    const std::vector<std::pair<size_t,double>>& resolveShares(const Expense& e) const;
+
+    // Update the per-user indexes for a newly stored (or restored) expense.
+    // 'summarized' expenses come from a closed period whose balance, pair
+    // and category-total effect is already applied.
+    void indexExpense(size_t id, bool summarized = false);
+
+    // Same, with the payer and participants already resolved to ids
+    // (unique, e.g. from resolveShares()).
+    void indexExpense(size_t id, size_t payer, const std::vector<std::pair<size_t,double>>& parts, bool summarized = false);
+
+    // Everything indexExpense() maintains besides the balances.
+    void indexSecondary(size_t id, size_t payer, const std::vector<std::pair<size_t,double>>& parts, bool summarized);
+
+    // Inverse of indexExpense(). Posting and trigram entries are left
+    // behind as stale ids; postings are pruned by compactStep(), trigram
+    // hits are re-checked by search().
+    void unindexExpense(size_t id);
+
+    // Index the expenses stored while balancesOnly was set. Anything that
+    // reads timelines, postings, pairs, rollups, groups, notes or the
+    // amount indexes must call this first if balancesOnly may have been on.
+    void catchUpIndexes();
+
+    // The amount indexes are ordered trees; inserting each new expense at a
+    // random amount costs a cache miss per level. New ids wait in
+    // amountPending and go in sorted, with a hint, before the next range
+    // query or erase.
+    void flushAmountIndex() const;
+
+    // Count a dead posting entry of user u; the list is queued for
+    // compaction once at least a quarter of it is dead.
+    void markStale(size_t u);
+
+    // Incremental compaction: each call looks at no more than 'budget'
+    // posting entries, resuming the pass where the last call stopped.
+    // A pass drops dead, stale and duplicate ids from one queued list
+    // (order is not restored; history sorts what it reads).
+    void compactStep(size_t budget = 64);
+
+    // Fold 'times' more occurrences of rule r into the balance, pair and
+    // rollup indexes (negative to retract). Timelines are not touched;
+    // as-of queries add rules in closed form.
+    void applyRule(size_t r, long long times);
+
+    // Bring every rule up to 'day'; O(rules) when nothing is due.
+    void refreshRecurring(int day);
+
+    void addRecurring(const RecurringRule& r);
+
+    // Drop rule r's occurrences dated after 'day'; any of them already
+    // folded into the book are retracted.
+    bool endRecurring(size_t r, int day, std::string& err);
+
+    void setRuleCount(size_t r, long long count);
+
+    // A payment raises the payer's balance and lowers the receiver's, and
+    // cancels that much of what 'from' owes 'to'. O(1) index updates
+    // (plus the ranked set for book-currency payments).
+    void applyTransfer(const Transfer& t, double sign);
+
+    void recordPayment(const Transfer& t);
+
+    // An import hash already in the book or staged in the open batch.
+    bool knownImport(uint64_t h) const;
+
+    // Apply the open batch: one journal record first (if journaling), then
+    // every expense and payment in a single pass. 'ranked' is updated once
+    // per touched user rather than once per balance delta. Each operation
+    // keeps its own undo entry. 'seq' numbers the batch, 0 = the next one.
+    bool commitBatch(std::string& err, uint64_t seq = 0);
+
+    // Between these two, balance changes skip 'ranked'; the end re-ranks
+    // each touched user once. No users may be added in between.
+    void beginDeferRanked();
+
+    void endDeferRanked();
+
+    // Remember a settle result so apply-settlement can record it.
+    void setPlan(const std::vector<std::tuple<std::string,std::string,double>>& txns, int currency);
+
+    // Build an equal-split expense (validation only, nothing stored)
+    bool buildExpenseEqual(const std::string& payer, double amount, const std::vector<std::string>& participants,
+                           const ExpenseMeta& meta, Expense& e, std::string& err) const;
+
+    // Build an exact-split expense from tokens like name:amount
+    bool buildExpenseExact(const std::string& payer, double amount, const std::vector<std::string>& tokens,
+                           const ExpenseMeta& meta, Expense& e, std::string& err) const;
+
+    // Build an expense from dense user ids (shares == nullptr: equal
+    // split). Range checks only; no name parsing or lookups. Leaves the
+    // (id, share) list, repeated ids merged, in shareIds.
+    bool buildExpenseByIds(uint32_t payer, double amount, const uint32_t* ids, const double* shares, size_t n,
+                           Expense& e, std::string& err) const;
+
+    // Build and store in one step (binary protocol). The shares are indexed
+    // by the ids given, so no participant is looked up by name.
+    bool addExpenseByIds(uint32_t payer, double amount, const uint32_t* ids, const double* shares, size_t n,
+                         std::string& err);
+
+    // Resolve names once; 'weights' (exact splits) are scaled to fractions.
+    bool prepareTemplate(const std::string& name, const std::string& payer, const std::vector<std::string>& participants,
+                         const std::vector<double>& weights, std::string& err);
+
+    // Add (or stage) one expense from a prepared split. Its ids are trusted
+    // while no user has been removed (undo) or the book reloaded since.
+    bool execTemplate(const ExpenseTemplate& t, double amount, const ExpenseMeta& meta, std::string& err);
+
+    void storeOrStage(Expense e);
+
+    // Takes the expense by value so freshly built ones are moved, not copied.
+    void storeExpense(Expense e);
+
+    // Same, with the payer and merged participant ids already known.
+    void storeExpense(Expense e, size_t payer, const std::vector<std::pair<size_t,double>>& parts);
+
+    // Add equal-split expense
+    bool addExpenseEqual(const std::string& payer, double amount, const std::vector<std::string>& participants, std::string& err,
+                         const ExpenseMeta& meta = ExpenseMeta());
+
+    // Add exact-split expense with tokens like name:amount
+    bool addExpenseExact(const std::string& payer, double amount, const std::vector<std::string>& tokens, std::string& err,
+                         const ExpenseMeta& meta = ExpenseMeta());
+
+    bool isSealed(size_t id) const { return id < sealedEnd; }
+
+    // Tombstone an expense: reverse its deltas and keep the payload for undo.
+    // 'compact' runs a compactStep() afterwards (redo passes false).
+    bool removeExpense(size_t id, std::string& err, bool compact = true);
+
+    // Swap in a new version of a live expense: reverse then forward deltas.
+    bool replaceExpense(size_t id, const Expense& e, bool compact = true);
+
+    // Seal every expense added since the last close. The summary is built
+    // once here, O(expenses in the period); closing also ends undo history.
+    bool closePeriod(const std::string& label, std::string& err);
+
+    // Apply a period summary read from a book file.
+    void applySummary(const PeriodSegment& seg);
+
+    // Read one closed period's expenses on first use.
+    bool loadSegment(PeriodSegment& seg, std::string& err);
+
+    // Everything that reads individual expenses calls this first.
+    bool loadSegments(std::string& err);
+
+    // Compute net for each user: +ve means others owe them
+    // (read from the incrementally maintained balance array of one
+    // currency: payer +amount, each participant -share)
+    std::map<std::string,double> computeNet(int currency = 0) const;
+
+    // All per-currency balances converted into 'target' in one pass per
+    // currency over contiguous arrays (out[u] += factor * bal_c[u]).
+    bool convertedNet(int target, std::map<std::string,double>& net, std::string& err) const;
+
+    // Currencies (other than the book currency) with any balance.
+    std::vector<int> activeCurrencies() const;
+
+    // Parse a rate table: one "<CODE> <book-currency value>" per line.
+    bool loadRates(const std::string& path, std::string& err);
+
+    // One currency's balances counting only expenses dated on or before
+    // 'day' (undated expenses always count). O(U log E) via the per-user
+    // timelines, plus O(1) per recurring rule.
+    std::map<std::string,double> balancesAsOf(int day, int currency = 0) const;
+
+    // Min-cash-flow settlement (greedy) of one currency's balances
+    std::vector<std::tuple<std::string,std::string,double>> settle(int currency = 0) const;
+
+    // Users linked by sharing an expense; each component nets to zero, in
+    // every currency, and can be settled on its own.
+    std::vector<std::vector<std::string>> components() const;
+
+    // Settlement of one currency's balances with a per-component engine
+    // choice (see settleAdaptive); 'comps' is components().
+    std::vector<std::tuple<std::string,std::string,double>> settleAuto(const std::vector<std::vector<std::string>>& comps, int currency,
+                                                    const SettleConfig& cfg, AutoStats& stats) const;
+
+    // Save / Load (very simple text format)
+    void writeExpenseBody(std::ostream& out, const Expense& e) const;
+
+    // <from> <to> <amount> <YYYY-MM-DD> [CCY]
+    void writePayment(std::ostream& out, const Transfer& t) const;
+
+    bool readPayment(const std::string& line, Transfer& t, std::string& err);
+
+    // Journal record for the open batch, in the save format's terms:
+    //   BATCH <seq> <expenses> <payments> / expense bodies / payment lines / COMMIT
+    // It goes out in one write followed by one fsync, so after a crash the
+    // journal ends in whole records plus at most one torn tail.
+    bool appendJournal(uint64_t seq, std::string& err) const;
+
+    // Re-apply the journal's committed batches on top of the book they
+    // followed. Records numbered at or below journalSeq are already in the
+    // book (it was saved after them) and are counted in 'skipped', so
+    // replaying after a save is harmless. A torn last record (a crash
+    // mid-write) is dropped and reported through 'torn'; anything else
+    // malformed is an error.
+    bool replayJournal(const std::string& path, size_t& applied, size_t& skipped, bool& torn, std::string& err);
+
+    // Closed periods go to <path>.<label>.seg; a segment already stored
+    // there is not rewritten, since sealed expenses never change.
+    bool save(const std::string& path, std::string& err);
+
+    // PAYER <name> AMT <amount> [DATE d] [CAT c] [CCY x] / SHARES <m> / m x "<name> <share>"
+    bool readExpenseBody(std::istream& in, Expense& e, std::string& err);
+
+    bool load(const std::string& path, std::string& err);
+};
+
+// Several books open at once over one shared user directory. Each book
+// keeps its own balance arrays; dirIds maps a book's user ids onto the
+// directory so the global net is a sum of those arrays.
+struct Workspace {
+    std::vector<std::unique_ptr<Book>> books;
+    std::vector<std::string> bookNames;
+    size_t current = 0;
+    std::vector<std::string> users;                   // directory id -> name
+    std::unordered_map<std::string,size_t> userIds;
+    std::vector<std::vector<size_t>> dirIds;          // per book: user id -> directory id
+    std::vector<char> aligned;                   // per book: dirIds is the identity prefix
+
+    Workspace(){ open("main"); }
+
+    Book& book(){ return *books[current]; }
+
+    // Switch to the named book, creating it if needed.
+    void open(const std::string& name);
+
+    size_t directoryId(const std::string& u);
+
+    // Bring book b's mapping up to date with users added, removed (undo)
+    // or reloaded since the last call; O(U) name checks, no expense scans.
+    void sync(size_t b);
+
+    // Per-currency net over every book, keyed by currency code ("" = book
+    // currency). Books whose users line up with the directory are added
+    // with a straight element-wise loop; others scatter through dirIds.
+    std::map<std::string, std::vector<double>> globalNet();
+
+    std::map<std::string,double> named(const std::vector<double>& v) const;
+};
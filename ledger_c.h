@@ -0,0 +1,72 @@
+/* C API for the ledger engine.
+ *
+ * Users are addressed by dense ids (0, 1, ...) in the order they were
+ * added. Batch calls validate every item before applying any, so a failed
+ * call leaves the book unchanged. Functions returning int give 0 on
+ * success and -1 on error, ledger_settle() gives LEDGER_ERROR;
+ * ledger_last_error() describes the last error.
+ * Output buffers are caller-owned: calls that fill one take its capacity
+ * and return the number of items available, which may exceed it. */
+#ifndef LEDGER_C_H
+#define LEDGER_C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ledger_book ledger_book;
+
+/* Error return of the size_t calls that can fail. */
+#define LEDGER_ERROR ((size_t)-1)
+
+/* One expense of a batch: its participants (and, for exact splits, their
+ * shares) are entries [first, first + count) of the batch's arrays. */
+typedef struct {
+    uint32_t payer;
+    double amount;
+    size_t first;
+    size_t count;
+} ledger_expense;
+
+typedef struct {
+    uint32_t from;
+    uint32_t to;
+    double amount;
+} ledger_transfer;
+
+ledger_book* ledger_create(void);
+void ledger_destroy(ledger_book* book);
+const char* ledger_last_error(const ledger_book* book);
+
+int ledger_load(ledger_book* book, const char* path);
+int ledger_save(ledger_book* book, const char* path);
+
+/* Adds n users; ids[i] receives each one's id (an existing name keeps its
+ * id). ids may be NULL. */
+int ledger_add_users(ledger_book* book, const char* const* names, size_t n, uint32_t* ids);
+
+/* Equal splits: participants holds the user ids for every expense. */
+int ledger_add_equal(ledger_book* book, const ledger_expense* expenses, size_t n,
+                     const uint32_t* participants);
+
+/* Exact splits: shares[k] is what participants[k] owes. */
+int ledger_add_exact(ledger_book* book, const ledger_expense* expenses, size_t n,
+                     const uint32_t* participants, const double* shares);
+
+size_t ledger_user_count(const ledger_book* book);
+
+/* Book-currency balances by user id (+ve receive, -ve pay). */
+size_t ledger_balances(const ledger_book* book, double* out, size_t cap);
+
+/* Greedy settlement of the book-currency balances; LEDGER_ERROR if it
+ * fails (e.g. out of memory). */
+size_t ledger_settle(const ledger_book* book, ledger_transfer* out, size_t cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
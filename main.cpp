@@ -2,286 +2,1538 @@
 #include <iomanip>
 #include <string>
 #include <map>
-#include <unordered_set>
 #include <vector>
+#include <array>
+#include <string_view>
 #include <tuple>
-#include <queue>
 #include <fstream>
 #include <sstream>
 #include <cmath>
 #include <algorithm>
 #include <limits>
-#include <utility>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdint>
+#include <random>
+#include <cstdio>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
 
-using namespace std;
-
-struct Expense {
-    string payer;
-    double amount{};
-    // participant -> share amount (absolute currency)
-    map<string,double> shares;
-};
-
-static constexpr double EPS = 1e-6;
+#include "ledger.h"
 
-struct Book {
-    unordered_set<string> users;
-    vector<Expense> expenses;
+using namespace std;
 
-    bool hasUser(const string& u) const { return users.count(u) != 0; }
-    void addUser(const string& u) { users.insert(u); }
+// ---- Hardware performance counters (profile <command...>, Linux only) ----
+// Each counter is opened on its own so a host that forbids one event
+// (common for dTLB in VMs) still reports the others.
+struct PerfCounters {
+    static const int N = 5;
+    int fd[N];
 
-    // Add equal-split expense
-    bool addExpenseEqual(const string& payer, double amount, const vector<string>& participants, string& err){
-        if (!hasUser(payer)) { err = "Unknown payer: " + payer; return false; }
-        if (participants.empty()) { err = "No participants."; return false; }
-        for (size_t i=0;i<participants.size();++i)
-            if (!hasUser(participants[i])) { err = "Unknown participant: " + participants[i]; return false; }
+    PerfCounters(){ for (int i=0;i<N;++i) fd[i] = -1; }
+    ~PerfCounters(){
+#ifdef __linux__
+        for (int i=0;i<N;++i) if (fd[i] >= 0) close(fd[i]);
+#endif
+    }
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
 
-        double share = amount / static_cast<double>(participants.size());
-        Expense e; e.payer = payer; e.amount = amount;
-        for (size_t i=0;i<participants.size();++i) e.shares[participants[i]] += share;
-        expenses.push_back(e);
-        return true;
+    static const char* name(int i){
+        static const char* names[N] = { "cycles", "instructions", "cache-misses", "branch-misses", "dTLB-misses" };
+        return names[i];
     }
 
-    // Add exact-split expense with tokens like name:amount
-    bool addExpenseExact(const string& payer, double amount, const vector<string>& tokens, string& err){
-        if (!hasUser(payer)) { err = "Unknown payer: " + payer; return false; }
-        if (tokens.empty()) { err = "No shares provided."; return false; }
-        Expense e; e.payer = payer; e.amount = amount;
-        double sumShares = 0.0;
-        for (size_t i=0;i<tokens.size();++i){
-            const string& t = tokens[i];
-            size_t pos = t.find(':');
-            if (pos==string::npos) { err = "Bad token '"+t+"', expected name:amount"; return false; }
-            string name = t.substr(0,pos);
-            double s = stod(t.substr(pos+1));
-            if (!hasUser(name)) { err = "Unknown participant: " + name; return false; }
-            e.shares[name] += s;
-            sumShares += s;
-        }
-        if (fabs(sumShares - amount) > 0.01) {
-            err = "Share sum (" + to_string(sumShares) + ") != amount (" + to_string(amount) + ")";
+    bool open(string& err){
+#ifdef __linux__
+        const unsigned long long dtlb = PERF_COUNT_HW_CACHE_DTLB
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        const unsigned types[N] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                    PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE };
+        const unsigned long long configs[N] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES, dtlb };
+        int opened = 0, lastErr = 0;
+        for (int i=0;i<N;++i){
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd[i] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+            if (fd[i] >= 0) ++opened; else lastErr = errno;
+        }
+        if (opened == 0){
+            err = string("perf_event_open: ") + strerror(lastErr) + "; check /proc/sys/kernel/perf_event_paranoid";
             return false;
         }
-        expenses.push_back(e);
         return true;
+#else
+        err = "not supported on this platform";
+        return false;
+#endif
     }
 
-    // Compute net for each user: +ve means others owe them
-    map<string,double> computeNet() const {
-        map<string,double> net;
-        for (unordered_set<string>::const_iterator it = users.begin(); it != users.end(); ++it)
-            net[*it] = 0.0;
-
-        for (size_t i=0;i<expenses.size();++i){
-            const Expense& e = expenses[i];
-            // payer paid entire amount upfront
-            net[e.payer] += e.amount;
-            // each participant owes their share
-            for (map<string,double>::const_iterator it = e.shares.begin(); it != e.shares.end(); ++it)
-                net[it->first] -= it->second;
-        }
-        // clamp tiny noise to 0
-        for (map<string,double>::iterator it = net.begin(); it != net.end(); ++it)
-            if (fabs(it->second) < 1e-9) it->second = 0.0;
-        return net;
-    }
-
-    // Min-cash-flow settlement (greedy)
-    vector<tuple<string,string,double>> settle() const {
-        map<string,double> net = computeNet();
-
-        struct Node { string name; double amt; }; // amt>0 creditor; amt<0 debtor
-        vector<Node> cred, debt;
-        for (map<string,double>::const_iterator it = net.begin(); it != net.end(); ++it) {
-            const string& u = it->first;
-            double amt = it->second;
-            if (amt > EPS) cred.push_back(Node{u, amt});
-            else if (amt < -EPS) debt.push_back(Node{u, amt});
-        }
-
-        // priority queues (max creditor, most negative debtor)
-        struct CmpCred { bool operator()(const Node& a, const Node& b) const { return a.amt < b.amt; } }; // max-heap
-        struct CmpDebt { bool operator()(const Node& a, const Node& b) const { return a.amt > b.amt; } }; // min (most negative) first
-        priority_queue<Node, vector<Node>, CmpCred> C(cred.begin(), cred.end());
-        priority_queue<Node, vector<Node>, CmpDebt> D(debt.begin(), debt.end());
-
-        vector<tuple<string,string,double>> txns;
-        while (!C.empty() && !D.empty()){
-            Node c = C.top(); C.pop();
-            Node d = D.top(); D.pop();
-            double pay = std::min(c.amt, -d.amt);
-            if (pay > EPS) txns.push_back(make_tuple(d.name, c.name, pay));
-            c.amt -= pay;
-            d.amt += pay;
-
-            if (c.amt > EPS) C.push(c);
-            if (d.amt < -EPS) D.push(d);
-        }
-        return txns;
-    }
-
-    // Save / Load (very simple text format)
-    bool save(const string& path, string& err) const {
-        ofstream out(path.c_str());
-        if (!out){ err="Cannot open file for writing."; return false; }
-        out << "USERS " << users.size() << "\n";
-        for (unordered_set<string>::const_iterator it = users.begin(); it != users.end(); ++it)
-            out << *it << "\n";
-        out << "EXPENSES " << expenses.size() << "\n";
-        out.setf(std::ios::fixed); out << setprecision(2);
-        for (size_t i=0;i<expenses.size();++i){
-            const Expense& e = expenses[i];
-            out << "PAYER " << e.payer << " AMT " << e.amount << "\n";
-            out << "SHARES " << e.shares.size() << "\n";
-            for (map<string,double>::const_iterator it=e.shares.begin(); it!=e.shares.end(); ++it)
-                out << it->first << " " << it->second << "\n";
+    void start(){
+#ifdef __linux__
+        for (int i=0;i<N;++i) if (fd[i] >= 0){
+            ioctl(fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd[i], PERF_EVENT_IOC_ENABLE, 0);
         }
-        return true;
+#endif
     }
 
-    bool load(const string& path, string& err){
-        ifstream in(path.c_str());
-        if (!in){ err="Cannot open file for reading."; return false; }
-        users.clear(); expenses.clear();
-
-        string tag; size_t n = 0;
-        if (!(in >> tag >> n) || tag!="USERS"){ err="Corrupt file (USERS)."; return false; }
-        in.ignore(numeric_limits<streamsize>::max(), '\n');
-        for (size_t i=0;i<n;++i){
-            string u; getline(in,u);
-            if (u.empty()) { --i; continue; }
-            users.insert(u);
-        }
-
-        if (!(in >> tag >> n) || tag!="EXPENSES"){ err="Corrupt file (EXPENSES)."; return false; }
-        for (size_t k=0;k<n;++k){
-            string tag1, tag2, payer; double amt;
-            if (!(in >> tag1 >> payer >> tag2 >> amt) || tag1 != "PAYER" || tag2 != "AMT") {
-                err = "Corrupt expense header.";
-                return false;
-            }
-            Expense e; e.payer = payer; e.amount = amt;
-
-            string tag3; size_t m = 0;
-            if (!(in >> tag3 >> m) || tag3!="SHARES"){ err="Corrupt shares tag."; return false; }
-            for (size_t i=0;i<m;++i){
-                string name; double s;
-                if (!(in >> name >> s)) { err="Corrupt share entry."; return false; }
-                e.shares[name]=s;
-            }
-            expenses.push_back(e);
+    // Fills vals with the deltas since start(); -1 marks an unavailable counter.
+    void stop(long long vals[N]){
+        for (int i=0;i<N;++i) vals[i] = -1;
+#ifdef __linux__
+        for (int i=0;i<N;++i) if (fd[i] >= 0){
+            ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0);
+            long long v = 0;
+            if (read(fd[i], &v, sizeof(v)) == static_cast<ssize_t>(sizeof(v))) vals[i] = v;
         }
-        return true;
+#endif
     }
 };
 
-static void printBalances(const map<string,double>& net){
-    cout << "Balances (+ receive, - pay)\n";
+static void printBalances(const map<string,double>& net, const string& currency = string()){
+    cout << "Balances" << (currency.empty() ? "" : " [" + currency + "]") << " (+ receive, - pay)\n";
     cout.setf(std::ios::fixed); cout << setprecision(2);
     for (map<string,double>::const_iterator it = net.begin(); it != net.end(); ++it){
         cout << "  " << setw(12) << left << it->first << " : " << (fabs(it->second)<EPS?0.0:it->second) << "\n";
     }
 }
 
-static void printTxns(const vector<tuple<string,string,double>>& txns){
+static void printTxns(const vector<tuple<string,string,double>>& txns, const string& currency = string()){
     cout.setf(std::ios::fixed); cout << setprecision(2);
-    if (txns.empty()){ cout << "Everyone is settled.\n"; return; }
-    cout << "Settlement transactions:\n";
+    string tag = currency.empty() ? "" : " [" + currency + "]";
+    if (txns.empty()){ cout << "Everyone is settled" << tag << ".\n"; return; }
+    cout << "Settlement transactions" << tag << ":\n";
     for (size_t i=0;i<txns.size();++i){
         const tuple<string,string,double>& t = txns[i];
         cout << "  " << get<0>(t) << " -> " << get<1>(t) << " : " << get<2>(t) << "\n";
     }
 }
 
-static void help(){
-    cout <<
-R"(Commands:
-  add-user <name>
-  add-expense equal <payer> <amount> <p1> <p2> ...
-  add-expense exact <payer> <amount> <name1:share1> <name2:share2> ...
-  balances
-  settle
-  save <file>
-  load <file>
-  help
-  exit
-)";
+// Expenses in an amount range, as returned by Book::expensesInRange().
+static void printExpenseList(const Book& book, const vector<size_t>& ids){
+    cout.setf(std::ios::fixed); cout << setprecision(2);
+    if (ids.empty()){ cout << "No matching expenses.\n"; return; }
+    cout << ids.size() << " expenses:\n";
+    for (size_t i=0;i<ids.size();++i){
+        const Expense& e = book.expenses[ids[i]];
+        cout << "  #" << setw(6) << left << ids[i] << " "
+             << (e.day != NO_DATE ? formatDate(e.day) : string("          "))
+             << "  " << e.payer << " paid " << e.amount;
+        if (e.currency != 0) cout << " " << book.currencies[e.currency];
+        if (e.category != 0) cout << " #" << book.categories[e.category];
+        if (e.noteLen) cout << "  \"" << book.noteOf(e) << "\"";
+        cout << "\n";
+    }
 }
 
-int main(){
-    ios::sync_with_stdio(false);
-    cin.tie(nullptr);
+// One line per expense the user paid for or shares in, in id order.
+static void printHistory(const Book& book, const string& user){
+    // the posting list may still hold stale ids not yet compacted away
+    vector<size_t> ids;
+    const vector<size_t>& posting = book.postings[book.userId(user)];
+    for (size_t i=0;i<posting.size();++i){
+        size_t id = posting[i];
+        if (!book.isLive(id)) continue;
+        const Expense& e = book.expenses[id];
+        if (e.payer == user || e.shares.count(user)) ids.push_back(id);
+    }
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+    cout.setf(std::ios::fixed); cout << setprecision(2);
+    long long occurrences = 0;
+    for (size_t r=0;r<book.rules.size();++r){
+        const Expense& e = book.rules[r].e;
+        if (e.payer == user || e.shares.count(user)) occurrences += book.rules[r].applied;
+    }
+    if (ids.empty() && occurrences == 0){ cout << "No expenses for " << user << ".\n"; return; }
+    cout << "History for " << user << " (" << ids.size() + occurrences << " expenses):\n";
+    for (size_t i=0;i<ids.size();++i){
+        const Expense& e = book.expenses[ids[i]];
+        ShareMap::const_iterator sh = e.shares.find(user);
+        cout << "  #" << setw(6) << left << ids[i] << " "
+             << (e.day != NO_DATE ? formatDate(e.day) : string("          "))
+             << "  " << e.payer << " paid " << e.amount;
+        if (sh != e.shares.end()) cout << ", share " << sh->second;
+        if (e.noteLen) cout << "  \"" << book.noteOf(e) << "\"";
+        cout << "\n";
+    }
+    // recurring rules are expanded only here, up to today
+    for (size_t r=0;r<book.rules.size();++r){
+        const RecurringRule& rule = book.rules[r];
+        const Expense& e = rule.e;
+        ShareMap::const_iterator sh = e.shares.find(user);
+        if (e.payer != user && sh == e.shares.end()) continue;
+        for (long long i=0;i<rule.applied;++i){
+            cout << "  r" << setw(6) << left << (to_string(r) + "." + to_string(i)) << " " << formatDate(rule.occurrence(i))
+                 << "  " << e.payer << " paid " << e.amount;
+            if (sh != e.shares.end()) cout << ", share " << sh->second;
+            cout << "\n";
+        }
+    }
+}
 
-    Book book;
-    cout << "Splitwise-CLI (C++). Type 'help' for commands.\n";
+static void printTop(const Book& book, size_t k, bool debtors){
+    vector<size_t> ids = book.top(k, debtors);
+    cout.setf(std::ios::fixed); cout << setprecision(2);
+    cout << "Top " << (debtors ? "debtors" : "creditors") << ":\n";
+    if (ids.empty()) cout << "  (none)\n";
+    for (size_t i=0;i<ids.size();++i)
+        cout << "  " << setw(12) << left << book.names[ids[i]] << " : " << book.bal[ids[i]] << "\n";
+}
 
-    string line;
+// Category report from the rollup counters; no expense is scanned. Each
+// currency is totalled on its own, tagged with its code.
+static void printCategoryReport(const Book& book, const string& user){
+    cout.setf(std::ios::fixed); cout << setprecision(2);
+    if (user.empty()){
+        cout << "Report by category:\n";
+        for (size_t c=0;c<book.categories.size();++c)
+            for (size_t k=0;k<book.currencies.size();++k){
+                const Rollup& r = book.categoryTotals[k][c];
+                if (r.count == 0) continue;
+                cout << "  " << setw(14) << left << (c ? book.categories[c] : string("(none)"))
+                     << " : " << r.count << " expenses, total " << r.paid << (k ? " " + book.currencies[k] : string()) << "\n";
+            }
+        return;
+    }
+    size_t u = book.userId(user);
+    cout << "Report by category for " << user << ":\n";
+    for (size_t c=0;c<book.categories.size();++c)
+        for (size_t k=0;k<book.currencies.size();++k){
+            unordered_map<uint64_t,Rollup>::const_iterator it = book.userRollups[k].find(Book::rollupKey(static_cast<int>(c), u));
+            if (it == book.userRollups[k].end() || it->second.count == 0) continue;
+            string code = k ? " " + book.currencies[k] : string();
+            cout << "  " << setw(14) << left << (c ? book.categories[c] : string("(none)"))
+                 << " : " << it->second.count << " expenses, paid " << it->second.paid << code
+                 << ", share " << it->second.share << code << "\n";
+        }
+}
+
+// Book-currency total, then ", <amount> <CCY>" for each other currency spent.
+static void printPaid(const Book& book, const vector<double>& paid){
+    cout << paid[0];
+    for (size_t k=1;k<paid.size();++k)
+        if (fabs(paid[k]) > EPS) cout << ", " << paid[k] << " " << book.currencies[k];
+}
+
+// Spending per closed period from the stored summaries, plus the open
+// period as the book totals minus those summaries; no expense is read.
+static void printPeriodReport(const Book& book){
+    cout.setf(std::ios::fixed); cout << setprecision(2);
+    cout << "Report by period:\n";
+    long long openCount = 0;
+    vector<double> openPaid(book.currencies.size(), 0.0);
+    for (size_t k=0;k<book.categoryTotals.size();++k)
+        for (size_t c=0;c<book.categoryTotals[k].size();++c){
+            openCount += static_cast<long long>(book.categoryTotals[k][c].count);
+            openPaid[k] += book.categoryTotals[k][c].paid;
+        }
+    for (size_t s=0;s<book.segments.size();++s){
+        const PeriodSegment& seg = book.segments[s];
+        long long count = 0;
+        vector<double> paid(book.currencies.size(), 0.0);
+        for (size_t k=0;k<seg.totals.size();++k)
+            for (size_t c=0;c<seg.totals[k].size();++c){
+                count += static_cast<long long>(seg.totals[k][c].count);
+                paid[k] += seg.totals[k][c].paid;
+            }
+        openCount -= count;
+        for (size_t k=0;k<paid.size();++k) openPaid[k] -= paid[k];
+        cout << "  " << setw(14) << left << seg.label << " : " << count << " expenses, total ";
+        printPaid(book, paid);
+        cout << (seg.loaded ? "" : "  (on disk)") << "\n";
+    }
+    cout << "  " << setw(14) << left << "(open)" << " : " << openCount << " expenses, total ";
+    printPaid(book, openPaid);
+    cout << "\n";
+}
+
+// ---- Command table ----
+// FNV-1a with a seed folded in; the table builder searches for a seed
+// under which every key lands in its own slot.
+constexpr uint32_t seededHash(string_view s, uint32_t seed){
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i=0;i<s.size();++i){ h ^= static_cast<unsigned char>(s[i]); h *= 16777619u; }
+    return h ^ (h >> 15);
+}
+
+// Perfect hash over a fixed key set, built at compile time: a lookup is one
+// hash, one slot read and one compare, independent of the number of keys.
+template<size_t SLOTS, size_t N>
+struct PerfectHash {
+    static_assert(N < SLOTS && N < 256 && (SLOTS & (SLOTS-1)) == 0, "SLOTS must be a power of two above N");
+    array<string_view, N> keys;
+    uint32_t seed = 0;              // 0 = no seed found (duplicate keys or too few slots)
+    array<uint8_t, SLOTS> slot{};   // key index + 1, 0 = empty
+
+    constexpr explicit PerfectHash(const array<string_view, N>& k) : keys(k) {
+        for (uint32_t s = 1; s < 4096 && seed == 0; ++s){
+            array<uint8_t, SLOTS> t{};
+            bool ok = true;
+            for (size_t i=0;i<N && ok;++i){
+                uint8_t& e = t[seededHash(keys[i], s) & (SLOTS-1)];
+                ok = (e == 0);
+                e = static_cast<uint8_t>(i + 1);
+            }
+            if (ok){ seed = s; slot = t; }
+        }
+    }
+
+    // Index of 's' among the keys, or -1.
+    constexpr int find(string_view s) const {
+        int i = slot[seededHash(s, seed) & (SLOTS-1)] - 1;
+        return (i >= 0 && keys[i] == s) ? i : -1;
+    }
+};
+
+enum class Cmd : uint8_t {
+    AddUser, AddExpense, EditExpense, RemoveExpense, Prepare, Exec, Import, ClosePeriod, AddRecurring,
+    EndRecurring, AddGroup, Balances, History, Top, Expenses, Search, Report, Owes, Undo, Redo, Settle, Book, Pay,
+    ApplySettlement, Begin, Commit, Rollback, Journal, Replay, Currency, Rate, LoadRates, Calibrate, Save, Load,
+    Profile, Help, Exit
+};
+
+enum : uint8_t {
+    CMD_STAGES = 1,     // inside a batch, each line stages one operation
+    CMD_NO_BATCH = 2    // changes the book directly, refused inside a batch
+};
+
+struct CommandSpec {
+    const char* name;
+    Cmd id;
+    int minArgs, maxArgs;   // whitespace-separated tokens after the name, -1 = no limit
+    uint8_t flags;
+    const char* usage;      // for help and arity errors; nullptr = unlisted alias
+};
+
+// In help order.
+static constexpr CommandSpec COMMANDS[] = {
+    { "add-user", Cmd::AddUser, 1, -1, CMD_NO_BATCH, "add-user <name>" },
+    { "add-expense", Cmd::AddExpense, 3, -1, CMD_STAGES,
+      "add-expense equal <payer> <amount>[CCY] <p1> <p2> ... [@YYYY-MM-DD] [#category] [%group] [\"note\"] [^ref]\n"
+      "  add-expense exact <payer> <amount>[CCY] <name1:share1> <name2:share2> ... [@YYYY-MM-DD] [#category] [%group] [\"note\"] [^ref]" },
+    { "edit-expense", Cmd::EditExpense, 4, -1, CMD_NO_BATCH,
+      "edit-expense <id> equal|exact <payer> <amount>[CCY] ... [@YYYY-MM-DD] [#category] [%group] [\"note\"]" },
+    { "remove-expense", Cmd::RemoveExpense, 1, 1, CMD_NO_BATCH, "remove-expense <id>" },
+    { "prepare", Cmd::Prepare, 3, -1, 0, "prepare <name> equal <payer> <p1> <p2> ... | prepare <name> exact <payer> <name:ratio> ..." },
+    { "exec", Cmd::Exec, 2, -1, CMD_STAGES, "exec <name> <amount>[CCY] [@YYYY-MM-DD] [#category] [%group] [\"note\"]" },
+    { "import", Cmd::Import, 1, 1, 0, "import <file>" },
+    { "close-period", Cmd::ClosePeriod, 1, 1, CMD_NO_BATCH, "close-period <label>" },
+    { "add-recurring", Cmd::AddRecurring, 5, -1, CMD_NO_BATCH,
+      "add-recurring <period> <count|until> equal|exact <payer> <amount>[CCY] ... [@start] [#category]" },
+    { "end-recurring", Cmd::EndRecurring, 1, 2, CMD_NO_BATCH, "end-recurring r<id> [YYYY-MM-DD]" },
+    { "add-group", Cmd::AddGroup, 1, 2, CMD_NO_BATCH, "add-group <name> [parent]" },
+    { "balances", Cmd::Balances, 0, 2, 0, "balances [--as-of <YYYY-MM-DD> | --in <CCY> | --group <name> | --global]" },
+    { "history", Cmd::History, 1, -1, 0, "history <user>" },
+    { "top", Cmd::Top, 1, 2, 0, "top <k> [debtors|creditors]" },
+    { "expenses", Cmd::Expenses, 0, 6, 0, "expenses [--min <x>] [--max <y>] [--payer <user>]" },
+    { "search", Cmd::Search, 1, -1, 0, "search <text>" },
+    { "report", Cmd::Report, 1, -1, 0, "report by-category [user] | report by-period" },
+    { "owes", Cmd::Owes, 2, 2, 0, "owes <A> <B>" },
+    { "undo", Cmd::Undo, 0, 0, CMD_NO_BATCH, "undo" },
+    { "redo", Cmd::Redo, 0, 0, CMD_NO_BATCH, "redo" },
+    { "settle", Cmd::Settle, 0, 2, 0, "settle [auto | --in <CCY> | --global]" },
+    { "book", Cmd::Book, 1, 2, 0, "book open <name> | book list" },
+    { "pay", Cmd::Pay, 3, 3, CMD_STAGES, "pay <from> <to> <amount>[CCY]" },
+    { "apply-settlement", Cmd::ApplySettlement, 0, 0, CMD_NO_BATCH, "apply-settlement" },
+    { "begin", Cmd::Begin, 0, 0, 0, "begin" },
+    { "commit", Cmd::Commit, 0, 0, 0, "commit" },
+    { "rollback", Cmd::Rollback, 0, 0, 0, "rollback" },
+    { "journal", Cmd::Journal, 1, 1, 0, "journal <file> | journal off" },
+    { "replay", Cmd::Replay, 1, 1, CMD_NO_BATCH, "replay <file>" },
+    { "currency", Cmd::Currency, 1, 1, 0, "currency <CCY>" },
+    { "rate", Cmd::Rate, 2, 2, 0, "rate <CCY> <value>" },
+    { "load-rates", Cmd::LoadRates, 1, 1, 0, "load-rates <file>" },
+    { "calibrate", Cmd::Calibrate, 0, 1, 0, "calibrate [budget-ms]" },
+    { "save", Cmd::Save, 1, 1, 0, "save <file>" },
+    { "load", Cmd::Load, 1, 1, CMD_NO_BATCH, "load <file>" },
+    { "profile", Cmd::Profile, 1, -1, 0, "profile <command...>" },
+    { "help", Cmd::Help, 0, 1, 0, "help [command]" },
+    { "exit", Cmd::Exit, 0, -1, 0, "exit" },
+    { "quit", Cmd::Exit, 0, -1, 0, nullptr },
+};
+static const size_t COMMAND_COUNT = sizeof COMMANDS / sizeof COMMANDS[0];
+
+template<size_t N>
+constexpr array<string_view, N> commandNames(const CommandSpec (&c)[N]){
+    array<string_view, N> names{};
+    for (size_t i=0;i<N;++i) names[i] = c[i].name;
+    return names;
+}
+
+static constexpr PerfectHash<256, COMMAND_COUNT> COMMAND_INDEX(commandNames(COMMANDS));
+static_assert(COMMAND_INDEX.seed != 0, "no collision-free seed for the command names; add slots");
+
+// The split type after add-expense, edit-expense, add-recurring and prepare.
+enum { SPLIT_EQUAL, SPLIT_EXACT };
+static constexpr PerfectHash<4, 2> SPLIT_INDEX(array<string_view, 2>{ { "equal", "exact" } });
+static_assert(SPLIT_INDEX.seed != 0, "no collision-free seed for the split types");
+
+static const CommandSpec* findCommand(const string& name){
+    int i = COMMAND_INDEX.find(name);
+    return i < 0 ? nullptr : &COMMANDS[i];
+}
+
+static void usage(const CommandSpec& c){
+    cout << "Usage: " << (c.usage ? c.usage : c.name) << "\n";
+}
+
+// Token count against the table's arity; prints the usage when it is off.
+static bool checkArity(const CommandSpec& c, const string& line){
+    int n = 0;
+    for (size_t i=0;i<line.size();++i)
+        if (!isspace(static_cast<unsigned char>(line[i])) && (i==0 || isspace(static_cast<unsigned char>(line[i-1])))) ++n;
+    n -= 1;   // the command itself
+    if (n >= c.minArgs && (c.maxArgs < 0 || n <= c.maxArgs)) return true;
+    usage(c);
+    return false;
+}
+
+static void help(const string& name = string()){
+    const CommandSpec* c = name.empty() ? nullptr : findCommand(name);
+    if (c){ cout << "  " << (c->usage ? c->usage : c->name) << "\n"; return; }
+    if (!name.empty()) cout << "Unknown command: " << name << "\n";
+    cout << "Commands:\n";
+    for (size_t i=0;i<COMMAND_COUNT;++i)
+        if (COMMANDS[i].usage) cout << "  " << COMMANDS[i].usage << "\n";
+}
+
+// ---- Settlement benchmark (--bench) ----
+// Runs every registered engine over generated balance vectors and prints
+// runtime, peak working memory (EngineHeap), transfer count and the gap to
+// a lower bound.
+static map<string,double> benchBalances(const string& dist, size_t n, mt19937& rng){
+    vector<double> v(n, 0.0);
+    if (dist=="uniform"){
+        uniform_real_distribution<double> U(-1000.0, 1000.0);
+        for (size_t i=0;i+1<n;++i) v[i] = round(U(rng) * 100.0) / 100.0;
+    } else if (dist=="skewed"){
+        // one big creditor paid for everyone
+        uniform_real_distribution<double> U(1.0, 50.0);
+        for (size_t i=1;i<n;++i) v[i] = -round(U(rng) * 100.0) / 100.0;
+    } else if (dist=="paired"){
+        // debtor/creditor pairs with identical amounts
+        uniform_real_distribution<double> U(1.0, 500.0);
+        for (size_t i=0;i+1<n;i+=2){ v[i] = round(U(rng) * 100.0) / 100.0; v[i+1] = -v[i]; }
+    } else { // "integer": few distinct values, many coincidences
+        uniform_int_distribution<int> U(-5, 5);
+        for (size_t i=0;i+1<n;++i) v[i] = 10.0 * U(rng);
+    }
+    // close the vector so it sums to zero
+    size_t last = (dist=="skewed") ? 0 : n-1;
+    double sum = 0.0;
+    for (size_t i=0;i<n;++i) if (i != last) sum += v[i];
+    v[last] = -sum;
+    shuffle(v.begin(), v.end(), rng);
+
+    map<string,double> net;
+    for (size_t i=0;i<n;++i) net["u" + to_string(i)] = v[i];
+    return net;
+}
+
+// ---- Binary protocol (--proto bin) ----
+// Frames in both directions: u32 length of what follows, u8 type, payload.
+// Integers are little-endian, amounts IEEE-754 doubles (little-endian).
+// Users are addressed by the dense id returned when they are added, so
+// no names are parsed or looked up per expense.
+//   1 add-user     u16 len, name bytes             -> OK(user id)
+//   2 add-equal    u32 payer, f64 amount, u32 n, n x u32 id        -> OK(expense id)
+//   3 add-exact    u32 payer, f64 amount, u32 n, n x (u32 id, f64 share) -> OK(expense id)
+//   4 balances                                      -> BALANCES u32 n, n x f64 (by user id)
+//   5 settle                                        -> SETTLE u32 n, n x (u32 from, u32 to, f64)
+//   6 load         u16 len, path bytes             -> OK(number of expenses)
+//   7 save         u16 len, path bytes             -> OK(number of expenses)
+// Any request may instead get ERROR with a message.
+enum BinType : uint8_t {
+    BIN_ADD_USER = 1, BIN_ADD_EQUAL = 2, BIN_ADD_EXACT = 3, BIN_BALANCES = 4, BIN_SETTLE = 5,
+    BIN_LOAD = 6, BIN_SAVE = 7,
+    BIN_OK = 0x80, BIN_ERROR = 0x81, BIN_BALANCES_REPLY = 0x84, BIN_SETTLE_REPLY = 0x85
+};
+
+struct BinReader {
+    const unsigned char* p;
+    const unsigned char* end;
+    bool ok = true;
+
+    uint64_t le(size_t n){
+        if (static_cast<size_t>(end - p) < n){ ok = false; p = end; return 0; }
+        uint64_t v = 0;
+        for (size_t i=0;i<n;++i) v |= static_cast<uint64_t>(p[i]) << (8*i);
+        p += n;
+        return v;
+    }
+    uint16_t u16(){ return static_cast<uint16_t>(le(2)); }
+    uint32_t u32(){ return static_cast<uint32_t>(le(4)); }
+    double f64(){ uint64_t v = le(8); double d; memcpy(&d, &v, sizeof d); return d; }
+};
+
+struct BinWriter {
+    vector<unsigned char> out;
+    size_t frameStart = 0;
+
+    void le(uint64_t v, size_t n){
+        size_t at = out.size();
+        out.resize(at + n);
+        for (size_t i=0;i<n;++i) out[at + i] = static_cast<unsigned char>(v >> (8*i));
+    }
+    void u32(uint32_t v){ le(v, 4); }
+    void f64(double d){ uint64_t v; memcpy(&v, &d, sizeof v); le(v, 8); }
+    void begin(uint8_t type){ frameStart = out.size(); le(0, 4); out.push_back(type); }
+    void end(){
+        uint32_t len = static_cast<uint32_t>(out.size() - frameStart - 4);
+        for (size_t i=0;i<4;++i) out[frameStart + i] = static_cast<unsigned char>(len >> (8*i));
+    }
+    void error(const string& msg){ begin(BIN_ERROR); out.insert(out.end(), msg.begin(), msg.end()); end(); }
+    void okId(uint64_t id){ begin(BIN_OK); le(id, 8); end(); }
+};
+
+// Buffers reused from frame to frame.
+struct BinScratch {
+    vector<uint32_t> ids;
+    vector<double> shares;
+};
+
+// A u16-length-prefixed string filling the rest of the payload.
+static bool binString(BinReader& r, string& out){
+    uint16_t len = r.u16();
+    if (!r.ok || static_cast<size_t>(r.end - r.p) != len || len == 0) return false;
+    out.assign(reinterpret_cast<const char*>(r.p), len);
+    return true;
+}
+
+// Apply one request frame (type + payload) and append its reply.
+static void binRequest(Book& book, uint8_t type, BinReader& r, BinWriter& w, BinScratch& s){
+    if (type == BIN_ADD_USER){
+        string name;
+        if (!binString(r, name)){ w.error("Bad add-user frame."); return; }
+        book.addUser(name);
+        w.okId(book.userId(name));
+    } else if (type == BIN_LOAD || type == BIN_SAVE){
+        string path, err;
+        if (!binString(r, path)){ w.error(type == BIN_LOAD ? "Bad load frame." : "Bad save frame."); return; }
+        bool ok = (type == BIN_LOAD) ? book.load(path, err) : book.save(path, err);
+        if (!ok){ w.error(err); return; }
+        if (type == BIN_LOAD) book.refreshRecurring(todayDays());
+        w.okId(book.expenses.size());
+    } else if (type == BIN_ADD_EQUAL || type == BIN_ADD_EXACT){
+        uint32_t payer = r.u32();
+        double amount = r.f64();
+        uint32_t n = r.u32();
+        size_t per = (type == BIN_ADD_EQUAL) ? 4 : 12;
+        if (!r.ok || static_cast<size_t>(r.end - r.p) != static_cast<size_t>(n) * per){ w.error("Bad expense frame."); return; }
+        s.ids.resize(n);
+        s.shares.resize(type == BIN_ADD_EXACT ? n : 0);
+        for (uint32_t i=0;i<n;++i){
+            s.ids[i] = r.u32();
+            if (type == BIN_ADD_EXACT) s.shares[i] = r.f64();
+        }
+        string err;
+        if (!book.addExpenseByIds(payer, amount, s.ids.data(), s.shares.empty() ? nullptr : s.shares.data(), n, err)){
+            w.error(err); return;
+        }
+        w.okId(book.expenses.size()-1);
+    } else if (type == BIN_BALANCES){
+        const vector<double>& b = book.bal;
+        w.begin(BIN_BALANCES_REPLY);
+        w.u32(static_cast<uint32_t>(b.size()));
+        for (size_t i=0;i<b.size();++i) w.f64(fabs(b[i]) < 1e-9 ? 0.0 : b[i]);
+        w.end();
+    } else if (type == BIN_SETTLE){
+        vector<tuple<string,string,double>> txns = book.settle();
+        w.begin(BIN_SETTLE_REPLY);
+        w.u32(static_cast<uint32_t>(txns.size()));
+        for (size_t i=0;i<txns.size();++i){
+            w.u32(static_cast<uint32_t>(book.userId(get<0>(txns[i]))));
+            w.u32(static_cast<uint32_t>(book.userId(get<1>(txns[i]))));
+            w.f64(get<2>(txns[i]));
+        }
+        w.end();
+    } else {
+        w.error("Unknown frame type.");
+    }
+}
+
+// Read stdin in 1 MiB blocks, apply every complete frame, and write the
+// replies for a block with one fwrite.
+static int runBinaryProtocol(Book& book){
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    book.refreshRecurring(todayDays());
+    // No frame reads history, as-of, report or pair indexes; keep only the
+    // balances current and leave the rest to a later load of the saved book.
+    book.balancesOnly = true;
+    const size_t BLOCK = 1 << 20;
+    vector<unsigned char> buf;
+    size_t head = 0;
+    BinWriter w;
+    BinScratch scratch;
     while (true){
-        cout << "> " << flush;
-        if (!getline(cin, line)) break;
-        if (line.empty()) continue;
+        size_t have = buf.size();
+        buf.resize(have + BLOCK);
+        size_t got = fread(buf.data() + have, 1, BLOCK, stdin);
+        buf.resize(have + got);
+        while (buf.size() - head >= 4){
+            BinReader len{buf.data() + head, buf.data() + buf.size()};
+            uint32_t n = len.u32();
+            if (n == 0){ w.error("Empty frame."); head += 4; continue; }
+            if (buf.size() - head - 4 < n) break;
+            const unsigned char* body = buf.data() + head + 4;
+            bool add = body[0] == BIN_ADD_EQUAL || body[0] == BIN_ADD_EXACT;
+            if (add != book.deferRanked){
+                if (add) book.beginDeferRanked(); else book.endDeferRanked();
+            }
+            BinReader r{body + 1, body + n};
+            binRequest(book, body[0], r, w, scratch);
+            head += 4 + n;
+        }
+        if (book.deferRanked) book.endDeferRanked();
+        if (!w.out.empty()){ fwrite(w.out.data(), 1, w.out.size(), stdout); w.out.clear(); }
+        if (head > 0){ buf.erase(buf.begin(), buf.begin() + head); head = 0; }
+        if (got == 0) break;
+    }
+    fflush(stdout);
+    if (!buf.empty()){ cerr << "Truncated frame at end of input.\n"; return 1; }
+    return 0;
+}
+
+static void runBenchmark(){
+    const size_t sizes[] = { 8, 16, 64, 512, 4096, 32768 };
+    const char* dists[] = { "uniform", "skewed", "paired", "integer" };
+    const vector<SettleEngine>& engines = settleEngines();
+    mt19937 rng(12345);
 
-        stringstream ss(line);
-        string cmd; ss >> cmd;
-        if (cmd=="exit" || cmd=="quit") break;
-        else if (cmd=="help"){ help(); continue; }
-        else if (cmd=="add-user"){
-            string name; getline(ss, name);
-            if(!name.empty() && name[0]==' ') name.erase(0,1);
-            if (name.empty()){ cout << "Usage: add-user <name>\n"; continue; }
-            book.addUser(name);
-            cout << "Added user: " << name << "\n";
-        }
-        else if (cmd=="add-expense"){
-            string type; ss >> type;
-            if (type=="equal"){
-                string payer; double amount;
-                ss >> payer >> amount;
-                vector<string> parts; string p;
-                while (ss >> p) parts.push_back(p);
-                string err;
-                if (!book.addExpenseEqual(payer, amount, parts, err)) cout << "Error: " << err << "\n";
-                else cout << "Added equal expense.\n";
-            } else if (type=="exact"){
-                string payer; double amount;
-                ss >> payer >> amount;
-                vector<string> tokens; string t;
-                while (ss >> t) tokens.push_back(t);
-                string err;
-                if (!book.addExpenseExact(payer, amount, tokens, err)) cout << "Error: " << err << "\n";
-                else cout << "Added exact expense.\n";
-            } else {
-                cout << "Usage: add-expense equal|exact ...  (see 'help')\n";
+    cout.setf(std::ios::fixed); cout << setprecision(3);
+    cout << setw(14) << left << "engine" << setw(9) << "dist" << setw(8) << right << "n"
+         << setw(11) << "us/run" << setw(10) << "peak-KB" << setw(10) << "xfers"
+         << setw(8) << "lower" << setw(7) << "gap" << setw(10) << "vs-greedy" << "\n";
+    for (size_t d=0; d<sizeof(dists)/sizeof(dists[0]); ++d){
+        for (size_t s=0; s<sizeof(sizes)/sizeof(sizes[0]); ++s){
+            size_t n = sizes[s];
+            map<string,double> net = benchBalances(dists[d], n, rng);
+            // lower bound: every creditor receives and every debtor pays at least once
+            size_t cred = 0, debt = 0;
+            for (map<string,double>::const_iterator it = net.begin(); it != net.end(); ++it){
+                if (it->second > EPS) ++cred; else if (it->second < -EPS) ++debt;
+            }
+            size_t lower = std::max(cred, debt);
+            size_t reps = std::max<size_t>(1, 20000 / n);
+
+            long long greedyXfers = -1;
+            for (size_t e=0;e<engines.size();++e){
+                if (engines[e].maxN && n > engines[e].maxN) continue;
+                g_engineHeap.cur = 0; g_engineHeap.peak = 0; g_engineHeap.on = true;
+                vector<tuple<string,string,double>> txns = engines[e].run(net);
+                g_engineHeap.on = false;
+                long long peak = g_engineHeap.peak;
+                txns.clear(); txns.shrink_to_fit();
+
+                chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+                size_t xfers = 0;
+                for (size_t r=0;r<reps;++r) xfers = engines[e].run(net).size();
+                double us = chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count() / static_cast<double>(reps);
+                if (e==0) greedyXfers = static_cast<long long>(xfers);
+
+                cout << setw(14) << left << engines[e].name << setw(9) << dists[d] << setw(8) << right << n
+                     << setw(11) << us << setw(10) << setprecision(1) << peak / 1024.0 << setprecision(3)
+                     << setw(10) << xfers << setw(8) << lower << setw(7) << (static_cast<long long>(xfers) - static_cast<long long>(lower))
+                     << setw(10) << (static_cast<long long>(xfers) - greedyXfers) << "\n";
             }
         }
-        else if (cmd=="balances"){
+    }
+}
+
+// Find the largest group the exact solver settles within the budget on
+// this host, and persist it for 'settle auto'.
+static void calibrate(double budgetMs){
+    mt19937 rng(777);
+    SettleConfig cfg = g_settleCfg;
+    cfg.budgetMs = budgetMs;
+    cfg.exactMax = 0;
+    cout.setf(std::ios::fixed); cout << setprecision(3);
+    for (size_t n=4; n<=EXACT_HARD_MAX; ++n){
+        map<string,double> net = benchBalances("uniform", n, rng);
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        settleExact(net);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+        cout << "  exact n=" << setw(2) << n << " : " << ms << " ms\n";
+        if (ms > budgetMs) break;
+        cfg.exactMax = n;
+    }
+    string err;
+    g_settleCfg = cfg;
+    if (cfg.save(SETTLE_CFG_PATH, err)) cout << "Calibrated exact_max=" << cfg.exactMax << ", saved to " << SETTLE_CFG_PATH << "\n";
+    else cout << "Error: " << err << "\n";
+}
+
+// Currency codes are letters only, so they can follow an amount.
+static bool validCurrencyCode(const string& code){
+    if (code.empty()) return false;
+    for (size_t i=0;i<code.size();++i) if (!isalpha(static_cast<unsigned char>(code[i]))) return false;
+    return true;
+}
+
+// "<number>[CCY]", e.g. 120 or 99.50EUR; a missing suffix keeps 'currency'.
+// The number is plain decimal (no exponent, hex, inf or nan) and CCY must
+// already be known to the book (declared with 'currency' or 'rate').
+static bool parseAmount(const string& tok, double& amount, int& currency, const Book& book, string& err){
+    size_t end = (!tok.empty() && (tok[0]=='-' || tok[0]=='+')) ? 1 : 0;
+    while (end < tok.size() && (isdigit(static_cast<unsigned char>(tok[end])) || tok[end]=='.')) ++end;
+    string num = tok.substr(0, end), code = tok.substr(end);
+    char* stop = nullptr;
+    double v = strtod(num.c_str(), &stop);
+    if (num.empty() || *stop || !std::isfinite(v) || (!code.empty() && !validCurrencyCode(code))){ err = "Bad amount '" + tok + "', expected <number>[CCY]"; return false; }
+    int c = book.findCurrency(code);
+    if (c < 0){ err = "Unknown currency '" + code + "'; declare it with 'currency " + code + "'"; return false; }
+    amount = v;
+    if (!code.empty()) currency = c;
+    return true;
+}
+
+static bool runCommand(Book& book, const string& line);
+static bool dispatchCommand(Book& book, const string& line);
+
+// Run one command under hardware counters and print the deltas.
+static void profileCommand(Book& book, const string& rest){
+    if (rest.empty()){ cout << "Usage: profile <command...>\n"; return; }
+    PerfCounters pc;
+    string err;
+    bool counting = pc.open(err);
+    if (!counting) cout << "Note: hardware counters unavailable (" << err << "); timing only.\n";
+
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    if (counting) pc.start();
+    runCommand(book, rest);
+    long long vals[PerfCounters::N];
+    if (counting) pc.stop(vals);
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+
+    cout.setf(std::ios::fixed); cout << setprecision(3);
+    cout << "Profile of '" << rest << "':\n";
+    cout << "  " << setw(14) << left << "wall-ms" << " : " << ms << "\n";
+    if (!counting) return;
+    for (int i=0;i<PerfCounters::N;++i){
+        cout << "  " << setw(14) << left << PerfCounters::name(i) << " : ";
+        if (vals[i] < 0) cout << "n/a\n"; else cout << vals[i] << "\n";
+    }
+    if (vals[0] > 0 && vals[1] >= 0)
+        cout << "  " << setw(14) << left << "ipc" << " : " << static_cast<double>(vals[1]) / static_cast<double>(vals[0]) << "\n";
+}
+
+// Execute one REPL line; returns false when the session should end.
+// Inside begin..commit, commands that would change the book outside the
+// batch are refused, and an add-expense/exec/pay line that stages nothing
+// counts as rejected so that commit refuses the whole batch.
+static bool runCommand(Book& book, const string& line){
+    if (!book.batch.open) return dispatchCommand(book, line);
+    string cmd;
+    stringstream(line) >> cmd;
+    const CommandSpec* spec = findCommand(cmd);
+    uint8_t flags = spec ? spec->flags : 0;
+    if (flags & CMD_NO_BATCH){ cout << "Error: " << cmd << " is not allowed inside a batch; commit or rollback first.\n"; return true; }
+    size_t mark = book.batch.size() + book.batch.skipped;
+    bool more = dispatchCommand(book, line);
+    if (!more) cout << "Discarded open batch (" << book.batch.size() << " staged).\n";
+    if ((flags & CMD_STAGES) && book.batch.size() + book.batch.skipped == mark)
+        ++book.batch.errors;
+    return more;
+}
+
+// Workspace-level commands (book, --global views); everything else runs
+// against the current book through runCommand.
+static bool runWorkspaceCommand(Workspace& ws, const string& line){
+    stringstream ss(line);
+    string cmd, opt;
+    ss >> cmd >> opt;
+    const CommandSpec* spec = findCommand(cmd);
+    Cmd id = spec ? spec->id : Cmd::Help;
+    if (spec && id==Cmd::Book){
+        if (!checkArity(*spec, line)) return true;
+        string name; ss >> name;
+        if (opt=="list"){
+            for (size_t i=0;i<ws.bookNames.size();++i)
+                cout << (i==ws.current ? "* " : "  ") << ws.bookNames[i] << " (" << ws.books[i]->names.size()
+                     << " users, " << ws.books[i]->expenses.size() << " expenses)\n";
+        } else if (opt=="open" && !name.empty()){
+            ws.open(name);
+            cout << "Current book: " << name << "\n";
+        } else {
+            usage(*spec);
+        }
+        return true;
+    }
+    if (spec && (id==Cmd::Settle || id==Cmd::Balances) && opt=="--global"){
+        map<string, vector<double>> net = ws.globalNet();
+        for (map<string, vector<double>>::const_iterator it = net.begin(); it != net.end(); ++it){
+            bool any = false;
+            for (size_t i=0;i<it->second.size() && !any;++i) any = fabs(it->second[i]) > EPS;
+            if (!any && !it->first.empty()) continue;
+            if (id==Cmd::Settle) printTxns(settleGreedy(ws.named(it->second)), it->first);
+            else printBalances(ws.named(it->second), it->first);
+        }
+        if (net.empty()) cout << "Everyone is settled.\n";
+        return true;
+    }
+    return runCommand(ws.book(), line);
+}
+
+// The @date #category %group "note" ^external-id attributes of an expense
+// line; any other token is collected in args.
+static bool parseAttributes(Book& book, istream& ss, vector<string>& args, ExpenseMeta& meta, string& ref, string& err){
+    string t;
+    while (ss >> t){
+        if (t[0]=='"'){
+            // "a note" runs to the token ending in a quote
+            string note = t.substr(1);
+            while ((note.empty() || note[note.size()-1] != '"') && ss >> t) note += " " + t;
+            if (note.empty() || note[note.size()-1] != '"'){ err = "Unterminated note"; break; }
+            note.erase(note.size()-1);
+            book.internNote(note, meta.noteOff, meta.noteLen);
+        }
+        else if (t[0]=='@'){ if (!parseDate(t.substr(1), meta.day)) err = "Bad date '" + t + "', expected @YYYY-MM-DD"; }
+        else if (t[0]=='#' && t.size() > 1) meta.category = book.internCategory(t.substr(1));
+        else if (t[0]=='^' && t.size() > 1) ref = t.substr(1);
+        else if (t[0]=='%' && t.size() > 1){
+            unordered_map<string,int>::const_iterator g = book.groupIds.find(t.substr(1));
+            if (g == book.groupIds.end()) err = "Unknown group '" + t.substr(1) + "'";
+            else if (book.groupChildren[g->second]) err = "Group '" + t.substr(1) + "' is not a leaf";
+            else meta.group = g->second;
+        }
+        else args.push_back(t);
+    }
+    return err.empty();
+}
+
+// Everything after "equal|exact" on an expense line: payer, amount with
+// optional currency, then participants and attributes.
+static bool parseExpenseTokens(Book& book, istream& ss, string& payer, double& amount, vector<string>& args,
+                               ExpenseMeta& meta, string& ref, string& err){
+    TraceSpan span("parse");
+    string amt;
+    ss >> payer >> amt;
+    parseAmount(amt, amount, meta.currency, book, err);
+    return parseAttributes(book, ss, args, meta, ref, err);
+}
+
+// isspace() in the C locale, without the call.
+static inline bool isBlank(char c){ return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+// Next whitespace-separated token of 'rest', as a view into the same
+// buffer; false at the end of the line.
+static bool nextToken(string_view& rest, string_view& tok){
+    const char* p = rest.data();
+    const char* end = p + rest.size();
+    while (p < end && isBlank(*p)) ++p;
+    if (p == end){ rest = string_view(); return false; }
+    const char* b = p;
+    while (p < end && !isBlank(*p)) ++p;
+    tok = string_view(b, static_cast<size_t>(p - b));
+    rest = string_view(p, static_cast<size_t>(end - p));
+    return true;
+}
+
+// YYYY-MM-DD in plain digits; other spellings parseDate() accepts take the
+// full parse.
+static bool quickDate(string_view s, int& day){
+    int f[3] = {0, 0, 0};
+    size_t i = 0;
+    for (int k=0;k<3;++k){
+        size_t b = i;
+        while (i < s.size() && isdigit(static_cast<unsigned char>(s[i])) && i - b < 9) f[k] = f[k]*10 + (s[i++] - '0');
+        if (i == b) return false;
+        if (k < 2){ if (i >= s.size() || s[i] != '-') return false; ++i; }
+    }
+    if (i != s.size() || f[1] < 1 || f[1] > 12 || f[2] < 1 || f[2] > daysInMonth(f[0], f[1])) return false;
+    day = daysFromCivil(f[0], f[1], f[2]);
+    return true;
+}
+
+// Scratch for quickImportHash(), reused across the rows of an import.
+struct ImportRow {
+    vector<string_view> args;
+    vector<pair<string_view,double>> shares;
+};
+
+// Content hash of an import row taken straight from the line (after
+// equal|exact): no Expense is built, nothing is interned or allocated.
+// False for any row it is not sure of (odd tokens, %group, errors); those
+// take the full parse, which also reports what is wrong with them.
+static bool quickImportHash(const Book& book, string_view rest, int split, ImportRow& row, uint64_t& h){
+    string_view payer, amt, ref, t;
+    if (!nextToken(rest, payer) || !nextToken(rest, amt)) return false;
+    size_t end = (amt[0]=='-' || amt[0]=='+') ? 1 : 0;
+    while (end < amt.size() && (isdigit(static_cast<unsigned char>(amt[end])) || amt[end]=='.')) ++end;
+    char* stop = nullptr;
+    double amount = strtod(amt.data(), &stop);
+    if (end == 0 || stop != amt.data() + end || !std::isfinite(amount)) return false;
+    int currency = 0, day = NO_DATE;
+    if (end < amt.size()){
+        string code(amt.substr(end));
+        if (!validCurrencyCode(code) || (currency = book.findCurrency(code)) < 0) return false;
+    }
+    row.args.clear();
+    while (nextToken(rest, t)){
+        if (t[0]=='"'){
+            bool closed = t.size() > 1 && t.back()=='"';
+            while (!closed && nextToken(rest, t)) closed = t.back()=='"';
+            if (!closed) return false;
+        }
+        else if (t[0]=='@'){ if (!quickDate(t.substr(1), day)) return false; }
+        else if (t[0]=='#' && t.size() > 1) continue;
+        else if (t[0]=='^' && t.size() > 1) ref = t.substr(1);
+        else if (t[0]=='%' && t.size() > 1) return false;
+        else row.args.push_back(t);
+    }
+    if (row.args.empty()) return false;
+    row.shares.clear();
+    double share = amount / static_cast<double>(row.args.size()), sum = 0.0;
+    for (size_t i=0;i<row.args.size();++i){
+        string_view name = row.args[i];
+        double s = share;
+        if (split==SPLIT_EXACT){
+            size_t pos = name.find(':');
+            if (pos == string_view::npos || pos + 1 == name.size()) return false;
+            s = strtod(name.data() + pos + 1, &stop);
+            if (stop != name.data() + name.size() || !std::isfinite(s)) return false;
+            name = name.substr(0, pos);
+            sum += s;
+        }
+        // insertion sort by name (a handful of participants); stable, so
+        // repeated names add up in line order as in the share map
+        size_t j = row.shares.size();
+        row.shares.push_back(make_pair(name, s));
+        for (; j > 0 && name < row.shares[j-1].first; --j) row.shares[j] = row.shares[j-1];
+        row.shares[j] = make_pair(name, s);
+    }
+    if (split==SPLIT_EXACT && fabs(sum - amount) > 0.01) return false;
+    size_t w = 0;
+    for (size_t i=0;i<row.shares.size();++i){
+        if (w && row.shares[w-1].first == row.shares[i].first) row.shares[w-1].second += row.shares[i].second;
+        else row.shares[w++] = row.shares[i];
+    }
+    row.shares.resize(w);
+    h = book.contentHash(payer, amount, currency, day, row.shares, ref);
+    return true;
+}
+
+// Import "equal|exact ..." lines (add-expense syntax without the command).
+// Rows whose content hash is already in the book are skipped, so
+// re-importing an overlapping export adds only the new rows. The hash is
+// checked before anything is built, so skipping a row allocates nothing.
+static void importFile(Book& book, const string& path){
+    ifstream in(path.c_str());
+    if (!in){ cout << "Error: Cannot open file for reading.\n"; return; }
+    size_t added = 0, skipped = 0, bad = 0, lineNo = 0;
+    string line;
+    ImportRow row;
+    while (getline(in, line)){
+        ++lineNo;
+        if (!line.empty() && line[line.size()-1]=='\r') line.erase(line.size()-1);
+        string_view rest(line), type;
+        if (!nextToken(rest, type) || type[0]=='#') continue;   // blank or comment
+        int split = SPLIT_INDEX.find(type);
+        uint64_t h = 0;
+        if (split >= 0 && quickImportHash(book, rest, split, row, h) && book.knownImport(h)){ ++skipped; continue; }
+        stringstream ls{string(rest)};
+        string payer, ref, err;
+        double amount = 0;
+        vector<string> args;
+        ExpenseMeta meta;
+        Expense e;
+        InternMark mark = book.internMark();
+        bool ok = split >= 0;
+        if (!ok) err = "expected equal|exact";
+        ok = ok && parseExpenseTokens(book, ls, payer, amount, args, meta, ref, err);
+        ok = ok && ((split==SPLIT_EQUAL) ? book.buildExpenseEqual(payer, amount, args, meta, e, err)
+                                    : book.buildExpenseExact(payer, amount, args, meta, e, err));
+        if (!ok){
+            book.dropInterned(mark);
+            if (++bad <= 5) cout << "  line " << lineNo << ": " << err << "\n";
+            continue;
+        }
+        e.importHash = book.contentHash(e, ref);
+        if (book.knownImport(e.importHash)){ book.dropInterned(mark); ++skipped; continue; }
+        book.storeOrStage(std::move(e));
+        ++added;
+    }
+    cout << (book.batch.open ? "Staged " : "Imported ") << added << " expenses, skipped " << skipped << " duplicates";
+    if (bad) cout << ", " << bad << " bad lines";
+    cout << ".\n";
+    if (book.batch.open){ book.batch.errors += bad; book.batch.skipped += skipped; }
+}
+
+// After storeOrStage: where the expense went.
+static void printAdded(const Book& book, const string& kind){
+    if (book.batch.open) cout << "Staged " << kind << "expense (" << book.batch.size() << " in batch).\n";
+    else cout << "Added " << kind << "expense (#" << book.expenses.size()-1 << ").\n";
+}
+
+// Closed periods are read from disk on first use by a command that
+// needs individual expenses.
+static bool needExpenses(Book& book){
+    string err;
+    if (book.loadSegments(err)) return true;
+    cout << "Error: " << err << "\n";
+    return false;
+}
+
+static bool dispatchCommand(Book& book, const string& line){
+    stringstream ss(line);
+    string cmd;
+    {
+        TraceSpan span("parse");
+        ss >> cmd;
+    }
+    book.refreshRecurring(todayDays());
+    const CommandSpec* spec = findCommand(cmd);
+    if (!spec){ cout << "Unknown command. Type 'help'.\n"; return true; }
+    if (!checkArity(*spec, line)) return true;
+    const Cmd op = spec->id;
+    switch (op){
+    case Cmd::Exit: return false;
+    case Cmd::Help: {
+        string name; ss >> name;
+        help(name);
+        break;
+    }
+    case Cmd::AddUser: {
+        string name; getline(ss, name);
+        if(!name.empty() && name[0]==' ') name.erase(0,1);
+        book.addUser(name);
+        cout << "Added user: " << name << "\n";
+        break;
+    }
+    case Cmd::AddGroup: {
+        string name, parent; ss >> name >> parent;
+        if (book.groupIds.count(name)){ cout << "Error: Group exists: " << name << "\n"; return true; }
+        int p = 0;
+        if (!parent.empty()){
+            unordered_map<string,int>::const_iterator g = book.groupIds.find(parent);
+            if (g == book.groupIds.end()){ cout << "Error: Unknown group: " << parent << "\n"; return true; }
+            if (!needExpenses(book)) return true;
+            if (book.groupExpenses[g->second]){ cout << "Error: Group " << parent << " already holds expenses.\n"; return true; }
+            p = g->second;
+        }
+        book.addGroup(name, p);
+        cout << "Added group: " << name << (p ? " under " + parent : string()) << "\n";
+        break;
+    }
+    case Cmd::AddExpense: case Cmd::EditExpense: case Cmd::AddRecurring: {
+        size_t id = 0;
+        ExpenseMeta meta;
+        RecurringRule rule;
+        int until = NO_DATE;
+        if (op==Cmd::AddRecurring){
+            string period, limit;
+            ss >> period >> limit;
+            if (!parsePeriod(period, rule.step, rule.months) || limit.empty()
+                || (!parseDate(limit, until) && !(stringstream(limit) >> rule.count))){
+                usage(*spec); return true;
+            }
+            meta.day = book.today;   // first occurrence defaults to today
+        }
+        if (op==Cmd::EditExpense){
+            if (!(ss >> id)){ usage(*spec); return true; }
+            if (!book.isLive(id)){ cout << "Error: No such expense: #" << id << "\n"; return true; }
+            if (book.isSealed(id)){ cout << "Error: Expense #" << id << " is in a closed period.\n"; return true; }
+            // attributes not given again are kept
+            meta.day = book.expenses[id].day;
+            meta.category = book.expenses[id].category;
+            meta.currency = book.expenses[id].currency;
+            meta.noteOff = book.expenses[id].noteOff;
+            meta.noteLen = book.expenses[id].noteLen;
+            meta.group = book.expenses[id].group;
+        }
+        string type; ss >> type;
+        int split = SPLIT_INDEX.find(type);
+        if (split < 0){ usage(*spec); return true; }
+        string payer, ref; double amount = 0;
+        vector<string> args;
+        string err;
+        InternMark mark = book.internMark();
+        bool kept = false;   // false: give back the line's notes and categories
+        if (!parseExpenseTokens(book, ss, payer, amount, args, meta, ref, err)){
+            book.dropInterned(mark);
+            cout << "Error: " << err << "\n"; return true;
+        }
+        if (op==Cmd::AddRecurring){
+            bool ok = (split==SPLIT_EQUAL) ? book.buildExpenseEqual(payer, amount, args, meta, rule.e, err)
+                                      : book.buildExpenseExact(payer, amount, args, meta, rule.e, err);
+            if (ok && until != NO_DATE){ rule.count = numeric_limits<long long>::max(); rule.count = rule.through(until); }
+            if (ok && rule.count <= 0){ ok = false; err = "Rule has no occurrences."; }
+            if (!ok) cout << "Error: " << err << "\n";
+            else {
+                kept = true;
+                book.addRecurring(rule);
+                cout << "Added recurring " << type << " expense r" << book.rules.size()-1 << " ("
+                     << rule.periodName() << ", " << rule.count << " occurrences).\n";
+            }
+        } else if (op==Cmd::AddExpense && (!ref.empty() || book.batch.open)){
+            // with an external id the add is idempotent, as in import
+            Expense e;
+            bool ok = (split==SPLIT_EQUAL) ? book.buildExpenseEqual(payer, amount, args, meta, e, err)
+                                      : book.buildExpenseExact(payer, amount, args, meta, e, err);
+            if (ok && !ref.empty()) e.importHash = book.contentHash(e, ref);
+            if (!ok) cout << "Error: " << err << "\n";
+            else if (e.importHash && book.knownImport(e.importHash)){
+                cout << "Skipped duplicate expense ^" << ref << ".\n";
+                if (book.batch.open) ++book.batch.skipped;
+            }
+            else { kept = true; book.storeOrStage(std::move(e)); printAdded(book, type + " "); }
+        } else if (op==Cmd::AddExpense){
+            bool ok = (split==SPLIT_EQUAL) ? book.addExpenseEqual(payer, amount, args, err, meta)
+                                      : book.addExpenseExact(payer, amount, args, err, meta);
+            kept = ok;
+            if (!ok) cout << "Error: " << err << "\n";
+            else cout << "Added " << type << " expense (#" << book.expenses.size()-1 << ").\n";
+        } else {
+            Expense e;
+            bool ok = (split==SPLIT_EQUAL) ? book.buildExpenseEqual(payer, amount, args, meta, e, err)
+                                      : book.buildExpenseExact(payer, amount, args, meta, e, err);
+            if (!ok) cout << "Error: " << err << "\n";
+            else { kept = true; book.replaceExpense(id, e); cout << "Edited expense #" << id << ".\n"; }
+        }
+        if (!kept) book.dropInterned(mark);
+        break;
+    }
+    case Cmd::Prepare: {
+        string name, type, payer;
+        ss >> name >> type >> payer;
+        int split = SPLIT_INDEX.find(type);
+        if (split < 0){ usage(*spec); return true; }
+        vector<string> participants;
+        vector<double> weights;
+        string t, err;
+        while (ss >> t){
+            if (split==SPLIT_EXACT){
+                size_t pos = t.find(':');
+                double w = 0;
+                if (pos==string::npos || !(stringstream(t.substr(pos+1)) >> w)){ err = "Bad token '" + t + "', expected name:ratio"; break; }
+                weights.push_back(w);
+                t.erase(pos);
+            }
+            participants.push_back(t);
+        }
+        if (err.empty() && book.prepareTemplate(name, payer, participants, weights, err))
+            cout << "Prepared " << type << " split '" << name << "' (" << participants.size() << " participants).\n";
+        else cout << "Error: " << err << "\n";
+        break;
+    }
+    case Cmd::Exec: {
+        string name, amt;
+        ss >> name >> amt;
+        unordered_map<string,ExpenseTemplate>::const_iterator it = book.templates.find(name);
+        if (it == book.templates.end()){ cout << "Error: No prepared split '" << name << "'.\n"; return true; }
+        ExpenseMeta meta;
+        double amount = 0;
+        string err;
+        InternMark mark = book.internMark();
+        parseAmount(amt, amount, meta.currency, book, err);
+        // attributes are optional; the bare "exec <name> <amount>" path parses nothing else
+        if (err.empty() && !ss.eof()){
+            string ref;
+            vector<string> rest;
+            if (parseAttributes(book, ss, rest, meta, ref, err) && !rest.empty())
+                err = "Unexpected token '" + rest[0] + "'";
+        }
+        if (err.empty() && book.execTemplate(it->second, amount, meta, err)) printAdded(book, "");
+        else { book.dropInterned(mark); cout << "Error: " << err << "\n"; }
+        break;
+    }
+    case Cmd::Import: {
+        string file; ss >> file;
+        if (!needExpenses(book)) return true;   // closed periods hold hashes too
+        importFile(book, file);
+        break;
+    }
+    case Cmd::EndRecurring: {
+        string ref, date; ss >> ref >> date;
+        size_t r = 0;
+        int day = book.today;   // last kept occurrence is on or before this day
+        if (ref.size() < 2 || ref[0]!='r' || !(stringstream(ref.substr(1)) >> r)
+            || (!date.empty() && !parseDate(date, day))){ usage(*spec); return true; }
+        string err;
+        if (book.endRecurring(r, day, err))
+            cout << "Ended recurring r" << r << " after " << formatDate(day) << " (" << book.rules[r].count << " occurrences).\n";
+        else cout << "Error: " << err << "\n";
+        break;
+    }
+    case Cmd::ClosePeriod: {
+        string label; ss >> label;
+        if (label.empty() || label.find_first_of("/\\") != string::npos){ usage(*spec); return true; }
+        string err;
+        if (book.closePeriod(label, err))
+            cout << "Closed period " << label << " (" << book.segments.back().end - book.segments.back().first << " expenses).\n";
+        else cout << "Error: " << err << "\n";
+        break;
+    }
+    case Cmd::RemoveExpense: {
+        size_t id = 0;
+        if (!(ss >> id)){ usage(*spec); return true; }
+        string err;
+        if (book.removeExpense(id, err)) cout << "Removed expense #" << id << ".\n";
+        else cout << "Error: " << err << "\n";
+        break;
+    }
+    case Cmd::Balances: {
+        string opt; ss >> opt;
+        if (opt.empty()){
             map<string,double> net = book.computeNet();
             printBalances(net);
+            vector<int> ccys = book.activeCurrencies();
+            for (size_t i=0;i<ccys.size();++i) printBalances(book.computeNet(ccys[i]), book.currencies[ccys[i]]);
+        } else if (opt=="--in"){
+            string code; ss >> code;
+            if (code.empty()){ usage(*spec); return true; }
+            map<string,double> net; string err;
+            int target = book.findCurrency(code);
+            if (target < 0) cout << "Error: Unknown currency: " << code << "\n";
+            else if (book.convertedNet(target, net, err)) printBalances(net, code);
+            else cout << "Error: " << err << "\n";
+        } else if (opt=="--as-of"){
+            string date; ss >> date;
+            int day = 0;
+            if (!parseDate(date, day)){ usage(*spec); return true; }
+            if (!needExpenses(book)) return true;
+            printBalances(book.balancesAsOf(day));
+            for (size_t k=1;k<book.currencies.size();++k){
+                map<string,double> net = book.balancesAsOf(day, static_cast<int>(k));
+                bool any = false;
+                for (map<string,double>::const_iterator it = net.begin(); it != net.end() && !any; ++it) any = it->second != 0.0;
+                if (any) printBalances(net, book.currencies[k]);
+            }
+        } else if (opt=="--group"){
+            string name; ss >> name;
+            if (!needExpenses(book)) return true;
+            unordered_map<string,int>::const_iterator g = book.groupIds.find(name);
+            if (g == book.groupIds.end()){ cout << "Error: Unknown group: " << name << "\n"; return true; }
+            printBalances(book.groupNet(g->second));
+            for (size_t k=1;k<book.currencies.size();++k){
+                map<string,double> net = book.groupNet(g->second, static_cast<int>(k));
+                if (!net.empty()) printBalances(net, book.currencies[k]);
+            }
+        } else {
+            usage(*spec);
         }
-        else if (cmd=="settle"){
+        break;
+    }
+    case Cmd::History: {
+        string user; getline(ss, user);
+        if(!user.empty() && user[0]==' ') user.erase(0,1);
+        if (!book.hasUser(user)){ cout << "Error: Unknown user: " << user << "\n"; return true; }
+        if (!needExpenses(book)) return true;
+        printHistory(book, user);
+        break;
+    }
+    case Cmd::Top: {
+        size_t k = 0; string side;
+        if (!(ss >> k)){ usage(*spec); return true; }
+        ss >> side;
+        if (side.empty() || side=="debtors") printTop(book, k, true);
+        if (side.empty() || side=="creditors") printTop(book, k, false);
+        if (!side.empty() && side!="debtors" && side!="creditors") usage(*spec);
+        break;
+    }
+    case Cmd::Search: {
+        string text; getline(ss, text);
+        size_t b = text.find_first_not_of(' ');
+        text = (b==string::npos) ? string() : text.substr(b);
+        if (!needExpenses(book)) return true;
+        printExpenseList(book, book.search(text));
+        break;
+    }
+    case Cmd::Expenses: {
+        double lo = -numeric_limits<double>::infinity(), hi = numeric_limits<double>::infinity();
+        size_t payer = NO_USER;
+        string opt;
+        while (ss >> opt){
+            string val;
+            bool ok = static_cast<bool>(ss >> val);
+            if (ok && opt=="--min") ok = static_cast<bool>(stringstream(val) >> lo);
+            else if (ok && opt=="--max") ok = static_cast<bool>(stringstream(val) >> hi);
+            else if (ok && opt=="--payer"){
+                if (!book.hasUser(val)){ cout << "Error: Unknown user: " << val << "\n"; return true; }
+                payer = book.userId(val);
+            }
+            else ok = false;
+            if (!ok){ usage(*spec); return true; }
+        }
+        if (!needExpenses(book)) return true;
+        printExpenseList(book, book.expensesInRange(lo, hi, payer));
+        break;
+    }
+    case Cmd::Report: {
+        string kind, user; ss >> kind;
+        getline(ss, user);
+        if(!user.empty() && user[0]==' ') user.erase(0,1);
+        if (kind=="by-period"){ printPeriodReport(book); return true; }
+        if (kind!="by-category"){ usage(*spec); return true; }
+        if (!user.empty() && !book.hasUser(user)){ cout << "Error: Unknown user: " << user << "\n"; return true; }
+        if (!user.empty() && !needExpenses(book)) return true;   // per-user rollups are not in period summaries
+        printCategoryReport(book, user);
+        break;
+    }
+    case Cmd::Owes: {
+        string a, b; ss >> a >> b;
+        if (!book.hasUser(a)){ cout << "Error: Unknown user: " << a << "\n"; return true; }
+        if (!book.hasUser(b)){ cout << "Error: Unknown user: " << b << "\n"; return true; }
+        cout.setf(std::ios::fixed); cout << setprecision(2);
+        bool any = false;
+        for (size_t k=0;k<book.currencies.size();++k){
+            double amt = book.pairs[k].owed(book.userId(a), book.userId(b));
+            string code = k ? " " + book.currencies[k] : string();
+            if (amt > EPS) cout << a << " owes " << b << " : " << amt << code << "\n";
+            else if (amt < -EPS) cout << b << " owes " << a << " : " << -amt << code << "\n";
+            else continue;
+            any = true;
+        }
+        if (!any) cout << a << " and " << b << " are even.\n";
+        break;
+    }
+    case Cmd::Undo: case Cmd::Redo: {
+        string what, err;
+        bool ok = (op==Cmd::Undo) ? book.undo(what, err) : book.redo(what, err);
+        if (ok) cout << (op==Cmd::Undo ? "Undid " : "Redid ") << what << "\n";
+        else cout << "Error: " << err << "\n";
+        break;
+    }
+    case Cmd::Settle: {
+        string mode; ss >> mode;
+        if (mode.empty()){
+            // each currency settles on its own
             vector<tuple<string,string,double>> txns = book.settle();
             printTxns(txns);
-        }
-        else if (cmd=="save"){
-            string file; ss >> file;
-            if (file.empty()){ cout << "Usage: save <file>\n"; continue; }
-            string err; 
-            if (book.save(file, err)) cout << "Saved to " << file << "\n";
+            book.setPlan(txns, 0);
+            vector<Transfer> plan = book.lastPlan;
+            vector<int> ccys = book.activeCurrencies();
+            for (size_t i=0;i<ccys.size();++i){
+                txns = book.settle(ccys[i]);
+                printTxns(txns, book.currencies[ccys[i]]);
+                book.setPlan(txns, ccys[i]);
+                plan.insert(plan.end(), book.lastPlan.begin(), book.lastPlan.end());
+            }
+            book.lastPlan.swap(plan);
+        } else if (mode=="--in"){
+            string code; ss >> code;
+            if (code.empty()){ usage(*spec); return true; }
+            map<string,double> net; string err;
+            int target = book.findCurrency(code);
+            if (target < 0) cout << "Error: Unknown currency: " << code << "\n";
+            else if (book.convertedNet(target, net, err)){
+                vector<tuple<string,string,double>> txns = settleGreedy(net);
+                printTxns(txns, code);
+                book.setPlan(txns, target);
+            }
             else cout << "Error: " << err << "\n";
+        } else if (mode=="auto"){
+            if (!needExpenses(book)) return true;   // components follow individual expenses
+            // per currency, as plain settle; the components are shared
+            AutoStats stats;
+            vector<vector<string>> comps;
+            {
+                TraceSpan span("settle.components");
+                comps = book.components();
+            }
+            vector<tuple<string,string,double>> txns = book.settleAuto(comps, 0, g_settleCfg, stats);
+            printTxns(txns);
+            book.setPlan(txns, 0);
+            vector<Transfer> plan = book.lastPlan;
+            vector<int> ccys = book.activeCurrencies();
+            for (size_t i=0;i<ccys.size();++i){
+                txns = book.settleAuto(comps, ccys[i], g_settleCfg, stats);
+                printTxns(txns, book.currencies[ccys[i]]);
+                book.setPlan(txns, ccys[i]);
+                plan.insert(plan.end(), book.lastPlan.begin(), book.lastPlan.end());
+            }
+            book.lastPlan.swap(plan);
+            cout << "Engines: " << stats.exact << " exact, " << stats.paired << " pairs+greedy, "
+                 << stats.greedy << " greedy (exact_max=" << g_settleCfg.exactMax << ")\n";
+        } else {
+            usage(*spec);
         }
-        else if (cmd=="load"){
-            string file; ss >> file;
-            if (file.empty()){ cout << "Usage: load <file>\n"; continue; }
-            string err;
-            if (book.load(file, err)) cout << "Loaded from " << file << "\n";
-            else cout << "Error: " << err << "\n";
+        break;
+    }
+    case Cmd::Pay: {
+        string from, to, amt;
+        ss >> from >> to >> amt;
+        Transfer t;
+        t.currency = 0;
+        string err;
+        if (!parseAmount(amt, t.amount, t.currency, book, err)){ cout << "Error: " << err << "\n"; return true; }
+        if (!(t.amount > 0)){ usage(*spec); return true; }
+        if (!book.hasUser(from) || !book.hasUser(to)){ cout << "Error: Unknown user.\n"; return true; }
+        if (from == to){ cout << "Error: Cannot pay yourself.\n"; return true; }
+        t.from = static_cast<uint32_t>(book.userId(from));
+        t.to = static_cast<uint32_t>(book.userId(to));
+        t.day = book.today;
+        if (book.batch.open){
+            book.batch.transfers.push_back(t);
+            cout << "Staged payment " << from << " -> " << to << " (" << book.batch.size() << " in batch).\n";
+            return true;
         }
-        else {
-            cout << "Unknown command. Type 'help'.\n";
+        book.recordPayment(t);
+        cout << "Recorded payment " << from << " -> " << to << " (#p" << book.transfers.size()-1 << ").\n";
+        break;
+    }
+    case Cmd::Begin: {
+        if (book.batch.open){ cout << "Error: A batch is already open.\n"; return true; }
+        book.batch.clear();
+        book.batch.open = true;
+        cout << "Batch open; add-expense, exec, import and pay are staged until commit.\n";
+        break;
+    }
+    case Cmd::Commit: case Cmd::Rollback: {
+        if (!book.batch.open){ cout << "Error: No open batch.\n"; return true; }
+        size_t ne = book.batch.expenses.size(), np = book.batch.transfers.size();
+        string err;
+        if (op==Cmd::Rollback){ book.batch.clear(); cout << "Rolled back " << ne + np << " staged operations.\n"; }
+        else if (book.batch.errors){
+            cout << "Error: " << book.batch.errors << " line(s) in the batch were rejected; nothing applied.\n";
+            book.batch.clear();
+        }
+        else if (book.commitBatch(err)) cout << "Committed " << ne << " expenses, " << np << " payments.\n";
+        else { cout << "Error: " << err << " Nothing applied.\n"; book.batch.clear(); }
+        break;
+    }
+    case Cmd::Journal: {
+        string file; ss >> file;
+        book.journalPath = (file=="off") ? string() : file;
+        if (file=="off") cout << "Journal off.\n";
+        else cout << "Journaling committed batches to " << file << "\n";
+        break;
+    }
+    case Cmd::Replay: {
+        string file; ss >> file;
+        size_t applied = 0, skipped = 0; bool torn = false;
+        string err;
+        bool ok = book.replayJournal(file, applied, skipped, torn, err);
+        cout << "Replayed " << applied << " batches from " << file;
+        if (skipped) cout << " (" << skipped << " already in the book)";
+        cout << "\n";
+        if (torn) cout << "Note: ignored an incomplete record at the end of the journal.\n";
+        if (!ok) cout << "Error: " << err << "\n";
+        break;
+    }
+    case Cmd::ApplySettlement: {
+        if (book.lastPlan.empty()){ cout << "Error: No settlement to apply; run 'settle' first.\n"; return true; }
+        vector<Transfer> plan; plan.swap(book.lastPlan);
+        for (size_t i=0;i<plan.size();++i) book.recordPayment(plan[i]);
+        cout << "Recorded " << plan.size() << " payments.\n";
+        break;
+    }
+    case Cmd::LoadRates: {
+        string file; ss >> file;
+        string err;
+        if (book.loadRates(file, err)) cout << "Loaded rates from " << file << "\n";
+        else cout << "Error: " << err << "\n";
+        break;
+    }
+    case Cmd::Currency: {
+        string code; ss >> code;
+        if (!validCurrencyCode(code)){ usage(*spec); return true; }
+        bool known = book.findCurrency(code) >= 0;
+        book.internCurrency(code);
+        cout << (known ? "Currency " : "Declared currency ") << code << "\n";
+        break;
+    }
+    case Cmd::Rate: {
+        string code; double r = 0;
+        if (!(ss >> code >> r) || !(r > 0) || !validCurrencyCode(code)){ usage(*spec); return true; }
+        book.rates[book.internCurrency(code)] = r;
+        cout << "Rate " << code << " = " << r << "\n";
+        break;
+    }
+    case Cmd::Calibrate: {
+        double budget = g_settleCfg.budgetMs;
+        ss >> budget;
+        if (!(budget > 0)){ usage(*spec); return true; }
+        calibrate(budget);
+        break;
+    }
+    case Cmd::Save: {
+        string file; ss >> file;
+        string err; 
+        if (book.save(file, err)) cout << "Saved to " << file << "\n";
+        else cout << "Error: " << err << "\n";
+        break;
+    }
+    case Cmd::Load: {
+        string file; ss >> file;
+        string err;
+        if (book.load(file, err)) cout << "Loaded from " << file << "\n";
+        else cout << "Error: " << err << "\n";
+        break;
+    }
+    case Cmd::Profile: {
+        string rest; getline(ss, rest);
+        size_t b = rest.find_first_not_of(' ');
+        rest = (b==string::npos) ? string() : rest.substr(b);
+        profileCommand(book, rest);
+        break;
+    }
+    case Cmd::Book:   // workspace-level; only reached through 'profile'
+        cout << "Error: book is a workspace command and cannot be profiled.\n";
+        break;
+    }
+    return true;
+}
+
+int main(int argc, char** argv){
+    ios::sync_with_stdio(false);
+    cin.tie(nullptr);
+
+    g_settleCfg.load(SETTLE_CFG_PATH);
+    bool binary = false;
+    for (int i=1;i<argc;++i){
+        string arg = argv[i];
+        if (arg=="--trace" && i+1<argc){ g_trace.on = true; g_trace.path = argv[++i]; }
+        else if (arg=="--bench"){ runBenchmark(); return 0; }
+        else if (arg=="--proto" && i+1<argc && (string(argv[i+1])=="bin" || string(argv[i+1])=="text")){
+            binary = (string(argv[++i])=="bin");
         }
+        else { cerr << "Usage: " << argv[0] << " [--trace <file>] [--bench] [--proto text|bin]\n"; return 1; }
+    }
+
+    Workspace ws;
+    if (binary){
+        // stdout carries frames only; diagnostics go to stderr
+        int rc = runBinaryProtocol(ws.book());
+        string err;
+        if (g_trace.on && !g_trace.flush(err)) cerr << "Error: " << err << "\n";
+        return rc;
+    }
+    cout << "Splitwise-CLI (C++). Type 'help' for commands.\n";
+
+    string line;
+    while (true){
+        cout << "> " << flush;
+        if (!getline(cin, line)) break;
+        if (line.empty()) continue;
+        if (!runWorkspaceCommand(ws, line)) break;
+    }
+    if (g_trace.on){
+        string err;
+        if (g_trace.flush(err)) cout << "Trace written to " << g_trace.path << "\n";
+        else cout << "Error: " << err << "\n";
     }
     cout << "Bye!\n";
     return 0;